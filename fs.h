@@ -1,11 +1,14 @@
 #include <stdint.h>
 
 /* Each descriptor is 1024 Byte which is the same as block size */
+/* The last 4 Byte of every descriptor hold a CRC32C of the rest of the
+ * block, seeded with its own block id */
 
 typedef struct file_descriptor {
-  char fname[256]; /* filename */
+  char fname[252]; /* filename */
   int fsize; /* file size */
   uint16_t bid[382]; /* block id of the file */
+  uint32_t csum; /* checksum of this block */
 } file_desc;
 
 struct entry {
@@ -14,10 +17,11 @@ struct entry {
 };
 
 typedef struct dir_descriptor {
-  char dname[256]; /* directory name */
+  char dname[252]; /* directory name */
   int dnum; /* how many files and directories in it? */
   uint16_t parbid; /* parent's bid */
   struct entry e[190]; /* entry block of the files and directories */
+  uint32_t csum; /* checksum of this block */
 } dir_desc;
     
 typedef struct superblock {
@@ -26,5 +30,45 @@ typedef struct superblock {
   /* 40 * 1024 blocks means 40 * 1024 bits for bitmap */
   /* 5 blocks needed */
   /* bitmap bids are 1 - 5 */
+  int ngroups; /* how many allocation groups */
+  int blocks_per_group; /* one bitmap block covers one group */
+  int gdt_bid; /* group descriptor bids are 7 - 11 */
+  int dedup; /* share identical data blocks? */
+  int ddt_bid; /* first block of the fingerprint table, 0 if none */
+  int ddt_used; /* fingerprints in the table */
+  int ref_bid; /* first block of the reference count table */
+  uint8_t pad[984]; /* fill the rest of the block */
+  uint32_t csum; /* checksum of this block */
 } superblock;
 
+/* One descriptor per allocation group, each in its own block so that
+ * groups can be updated without touching each other */
+
+typedef struct group_descriptor {
+  uint16_t bitmap_bid; /* bitmap block of this group */
+  uint16_t first_bid; /* first block covered by the bitmap */
+  uint16_t nblocks; /* how many blocks in this group */
+  uint16_t free_blocks; /* how many of them are still free */
+  uint32_t bitmap_csum; /* checksum of the bitmap block */
+  uint8_t pad[1008]; /* fill the rest of the block */
+  uint32_t csum; /* checksum of this block */
+} group_desc;
+
+/* Deduplication: an open addressing table of data block fingerprints, and
+ * one extra-reference counter per block (0 means a single owner) */
+
+struct ddt_entry {
+  uint64_t hash; /* xxh64 of the block */
+  uint16_t bid; /* block holding that content, 0 if the slot is empty */
+};
+
+typedef struct ddt_block {
+  struct ddt_entry e[63];
+  uint8_t pad[12];
+  uint32_t csum; /* checksum of this block */
+} ddt_block;
+
+typedef struct ref_block {
+  uint16_t refs[510]; /* extra references of each block */
+  uint32_t csum; /* checksum of this block */
+} ref_block;
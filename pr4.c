@@ -1,17 +1,23 @@
 /* CMPSC 473, Project 4, starter kit
  */
 
+#define _GNU_SOURCE
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
 #include <string.h>
 #include <math.h>
+#include <pthread.h>
+#include <time.h>
+#include <fcntl.h>
+#include <sys/mman.h>
 #include "fs.h"
 
 /*--------------------------------------------------------------------------------*/
 
 int debug = 0;  // extra output; 1 = on, 0 = off
-void *disk = NULL;
+struct blkdev *dev = NULL; /* the disk, see do_root */
 int cwd;
 /*--------------------------------------------------------------------------------*/
 
@@ -21,6 +27,8 @@ int cwd;
  * command  action
  * -------  ------
  *  root    initialize root directory
+ *                (filename = device: mem, file or async; filesize = image path)
+ *  mount   attach an existing image instead (filename, filesize as for root)
  *  print   print current working directory and all descendants
  *  chdir   change current working directory
  *                (.. refers to parent directory, as in Unix)
@@ -31,13 +39,31 @@ int cwd;
  *  rmfil        delete
  *  mvfil        rename
  *  szfil        resize (sz = size)
+ *  rdfil        read all of it and print its checksum
+ *  wrfil        fill it with copies of the string given as filesize
+ *  dedup   share identical data blocks (filename = on or off)
+ *  dedup-stats  report the blocks saved by dedup
+ *  sync    write back everything in the buffer cache
+ *  begin   start a transaction
+ *  commit  write all blocks changed since begin, each once
+ *  abort   undo everything since begin
+ *  fsck    check every checksum and rebuild the bitmap from reachable blocks
+ *                (filename = threads, default one per cpu)
+ *  bench   parallel block allocation benchmark
+ *                (filename = threads, filesize = allocations per thread)
  *  exit        quit the program immediately
  */
 
+/* Run as `pr4 --compile < script > script.bin` to turn such a script into
+ * the binary command stream described above compile(), and as
+ * `pr4 --binary < script.bin` to run one.
+ */
+
 /* The size argument is usually ignored.
  * The return value is 0 (success) or -1 (failure).
  */
 int do_root (char *name, char *size);
+int do_mount(char *name, char *size);
 int do_print(char *name, char *size);
 int do_chdir(char *name, char *size);
 int do_mkdir(char *name, char *size);
@@ -47,36 +73,77 @@ int do_mkfil(char *name, char *size);
 int do_rmfil(char *name, char *size);
 int do_mvfil(char *name, char *size);
 int do_szfil(char *name, char *size);
+int do_rdfil(char *name, char *size);
+int do_wrfil(char *name, char *size);
+int do_dedup(char *name, char *size);
+int do_dedup_stats(char *name, char *size);
+int do_sync (char *name, char *size);
+int do_begin(char *name, char *size);
+int do_commit(char *name, char *size);
+int do_abort(char *name, char *size);
+int do_fsck (char *name, char *size);
+int do_bench(char *name, char *size);
 int do_exit (char *name, char *size);
 
 struct action {
     char *cmd;                    // pointer to string
     int (*action)(char *name, char *size);    // pointer to function
+    int op;                       // opcode in binary streams, never reused
 } table[] = {
-    { "root" , do_root  },
-    { "print", do_print },
-    { "chdir", do_chdir },
-    { "mkdir", do_mkdir },
-    { "rmdir", do_rmdir },
-    { "mvdir", do_mvdir },
-    { "mkfil", do_mkfil },
-    { "rmfil", do_rmfil },
-    { "mvfil", do_mvfil },
-    { "szfil", do_szfil },
-    { "exit" , do_exit  },
-    { NULL, NULL }  // end marker, do not remove
+    { "root" , do_root  ,  0 },
+    { "print", do_print ,  1 },
+    { "chdir", do_chdir ,  2 },
+    { "mkdir", do_mkdir ,  3 },
+    { "rmdir", do_rmdir ,  4 },
+    { "mvdir", do_mvdir ,  5 },
+    { "mkfil", do_mkfil ,  6 },
+    { "rmfil", do_rmfil ,  7 },
+    { "mvfil", do_mvfil ,  8 },
+    { "szfil", do_szfil ,  9 },
+    { "rdfil", do_rdfil , 10 },
+    { "wrfil", do_wrfil , 11 },
+    { "dedup", do_dedup , 12 },
+    { "dedup-stats", do_dedup_stats , 13 },
+    { "sync" , do_sync  , 14 },
+    { "begin", do_begin , 15 },
+    { "commit", do_commit , 16 },
+    { "abort", do_abort , 17 },
+    { "fsck" , do_fsck  , 18 },
+    { "bench", do_bench , 19 },
+    { "exit" , do_exit  , 20 },
+    { "mount", do_mount , 21 },
+    { NULL, NULL, -1 }  // end marker, do not remove
 };
 
 /*--------------------------------------------------------------------------------*/
 
 void parse(char *buf, int *argc, char *argv[]);
+int compile(FILE *in, FILE *out);
+int run_binary(int fd);
+void crc32c_init(void);
+void close_disk(void);
+int txn_check(void);
 
 #define LINESIZE 128
+#define ARGMAX 251 /* longest argument in a binary stream, fits fname */
+#define CHUNKSIZE (1024 * 1024) /* binary stream read size */
+#define BINMAGIC "PR4\001" /* first 4 Byte of a binary stream */
 #define DISKSIZE (40*1024*1024)
 #define BLOCKSIZE 1024
 #define BLOCKSIZEWORD (1024 / 4)
 #define BLOCKNUM (DISKSIZE / BLOCKSIZE) /* how many blocks */
 #define BITMAPSIZEWORD (DISKSIZE / BLOCKSIZE / 32)
+#define BLOCKSPERGROUP (BLOCKSIZE * 8) /* one bitmap block per group */
+#define NGROUPS (BLOCKNUM / BLOCKSPERGROUP)
+#define GDTBID 7 /* group descriptors are blocks 7 - 11 */
+#define RESERVEDBLOCKS (GDTBID + NGROUPS) /* superblock .. last group descriptor */
+#define TRIMSIZE (64 * 1024) /* smallest freed extent handed back to the OS */
+#define NBUF 512 /* buffer cache size in blocks */
+#define RAMAX 32 /* largest readahead window in blocks */
+#define IOTHREADS 4 /* I/O threads of the async backend */
+#define NDDTBLOCKS 256 /* fingerprint table size in blocks */
+#define NDDT (NDDTBLOCKS * 63) /* fingerprint table slots */
+#define NREFBLOCKS ((BLOCKNUM + 509) / 510) /* reference count table size */
 
 /*--------------------------------------------------------------------------------*/
 
@@ -88,9 +155,25 @@ int main(int argc, char *argv[]) {
     int n;
     char *a[LINESIZE];
 
+    crc32c_init();
+    atexit(close_disk); /* dirty buffers must reach the image at EOF too */
+
+    if (argc > 1 && !strcmp(argv[1], "--compile"))
+        return compile(stdin, stdout);
+    if (argc > 1 && !strcmp(argv[1], "--binary"))
+        return run_binary(STDIN_FILENO);
+
     while (fgets(in, LINESIZE, stdin) != NULL) {
         // commands are all like "cmd filename filesize\n" with whitespace between
 
+        if (strchr(in, '\n') == NULL && !feof(stdin)) {
+            int c;
+            while ((c = getchar()) != EOF && c != '\n')
+                ;
+            printf("line too long (more than %d characters), skipped\n", LINESIZE - 2);
+            continue;
+        }
+
         // parse in
         parse(in, &n, a);
 
@@ -106,6 +189,8 @@ int main(int argc, char *argv[]) {
             if (strcmp(ptr->cmd, cmd) == 0) {
                 found = 1;
                 int ret = (ptr->action)(fnm, fsz);
+                if (txn_check() == -1)
+                    ret = -1;
                 if (ret == -1) {
                     printf("  %s %s %s: failed\n", cmd, fnm, fsz);
                 }
@@ -135,19 +220,24 @@ void set_bit(uint32_t *bitmap, int n) {
     bitmap[word] |= 1 << bit;
 }
 
-uint16_t empty_bid(uint32_t *bitmap) {
-    int i, j;
-    for (i = 0; i < BITMAPSIZEWORD; i++) {
-        if (bitmap[i] == 0xFFFFFFFF)
+int test_bit(uint32_t *bitmap, int n) {
+    int word = n / 32;
+    int bit = n % 32;
+
+    return (bitmap[word] >> bit) & 1;
+}
+
+/* first clear bit at or after word `start`, wrapping around; -1 if none */
+int empty_bit(uint32_t *bitmap, int nwords, int start) {
+    int i, w;
+    for (i = 0; i < nwords; i++) {
+        w = (start + i) % nwords;
+        if (bitmap[w] == 0xFFFFFFFF)
             continue;
-        for (j = 0; j < 32; j++) {
-            if (!(bitmap[i] & (1 << j)))
-                return (i * 32 + j);
-        }
+        return w * 32 + __builtin_ctz(~bitmap[w]);
     }
-    /* file system is full */
-    return 0;
-
+    /* bitmap is full */
+    return -1;
 }
 /*--------------------------------------------------------------------------------*/
 void print_bitmap(uint32_t *bitmap, int n) {
@@ -161,11 +251,13 @@ void print_bitmap(uint32_t *bitmap, int n) {
     printf("\n");
 }
 
-void print_block(void *disk, int bid) {
+void read_block(void *data, int bid);
+
+void print_block(int bid) {
     int i;
     uint8_t b[BLOCKSIZE];
 
-    memcpy(b, &((uint8_t *)disk)[bid * BLOCKSIZE], BLOCKSIZE);
+    read_block(b, bid);
 
     printf("print_block %d", bid);
     for (i = 0; i < BLOCKSIZE; i++) {
@@ -177,278 +269,1573 @@ void print_block(void *disk, int bid) {
 }
 
 /*--------------------------------------------------------------------------------*/
-void write_block(void *data, int bid) {
-    uint8_t *b = &((uint8_t *)disk)[bid * BLOCKSIZE];
-    memcpy(b, data, BLOCKSIZE);
-}
 
-void read_block(void *data, int bid) {
-    uint8_t *b = &((uint8_t *)disk)[bid * BLOCKSIZE];
-    memcpy(data, b, BLOCKSIZE);
+/* CRC32C (Castagnoli), using the SSE4.2 crc32 instruction when the cpu has
+ * it and slice-by-8 tables otherwise. The crc32c_* helpers work on the raw
+ * crc register; crc32c() adds the usual pre and post inversion.
+ */
+#define CRC32C_POLY 0x82F63B78
+#define CRC32C_STRIDE 336 /* bytes per stream when hashing a metadata block */
+
+uint32_t crc32c_table[8][256];
+uint32_t crc32c_shift1[4][256]; /* skip CRC32C_STRIDE zero bytes */
+uint32_t crc32c_shift2[4][256]; /* skip 2 * CRC32C_STRIDE zero bytes */
+int crc32c_hw = 0;
+
+uint32_t crc32c_sw(uint32_t crc, const void *buf, size_t len) {
+    const uint8_t *p = buf;
+    uint64_t v;
+
+    while (len >= 8) {
+        memcpy(&v, p, 8);
+        v ^= crc;
+        crc = crc32c_table[7][v & 0xff] ^ crc32c_table[6][(v >> 8) & 0xff] ^
+              crc32c_table[5][(v >> 16) & 0xff] ^ crc32c_table[4][(v >> 24) & 0xff] ^
+              crc32c_table[3][(v >> 32) & 0xff] ^ crc32c_table[2][(v >> 40) & 0xff] ^
+              crc32c_table[1][(v >> 48) & 0xff] ^ crc32c_table[0][v >> 56];
+        p += 8;
+        len -= 8;
+    }
+    while (len--)
+        crc = crc32c_table[0][(crc ^ *p++) & 0xff] ^ (crc >> 8);
+    return crc;
 }
 
-void update_parent(dir_desc *update, int file_or_dir, int bid) {
-    for (int i = 0; i < 190; i++) {
-        if (update->e[i].bid == 0) {
-            update->e[i].bid = bid;
-            update->e[i].type = file_or_dir;
-            return;
-        }
+#if defined(__x86_64__)
+__attribute__((target("sse4.2")))
+uint32_t crc32c_sse42(uint32_t crc, const void *buf, size_t len) {
+    const uint8_t *p = buf;
+    uint64_t c = crc, v;
+
+    while (len >= 8) {
+        memcpy(&v, p, 8);
+        c = __builtin_ia32_crc32di(c, v);
+        p += 8;
+        len -= 8;
     }
-
-    fprintf(stderr, "ERROR: NOT ENOUGH SPACE IN DIRECTORY\n");
+    crc = c;
+    while (len--)
+        crc = __builtin_ia32_crc32qi(crc, *p++);
+    return crc;
 }
 
-int add_block(file_desc *file, int bid) {
-    for (int i = 0; i < 382; i++) {
-        if (file->bid[i] == 0) {
-            file->bid[i] = bid;
-            if (debug)
-                printf ("wrote %d to file[%d]\n", bid, i);
-            return 0;
+/* three independent streams hide the latency of the crc32 instruction;
+ * their results are merged with the shift tables */
+__attribute__((target("sse4.2")))
+uint32_t crc32c_sse42_3way(uint32_t crc, const uint8_t *p) {
+    uint64_t c0 = crc, c1 = 0, c2 = 0, v0, v1, v2;
+
+    for (int i = 0; i < CRC32C_STRIDE; i += 8) {
+        memcpy(&v0, p + i, 8);
+        memcpy(&v1, p + CRC32C_STRIDE + i, 8);
+        memcpy(&v2, p + 2 * CRC32C_STRIDE + i, 8);
+        c0 = __builtin_ia32_crc32di(c0, v0);
+        c1 = __builtin_ia32_crc32di(c1, v1);
+        c2 = __builtin_ia32_crc32di(c2, v2);
+    }
+    crc = c2;
+    for (int k = 0; k < 4; k++) {
+        crc ^= crc32c_shift2[k][(c0 >> (8 * k)) & 0xff];
+        crc ^= crc32c_shift1[k][(c1 >> (8 * k)) & 0xff];
+    }
+    return crc;
+}
+#endif
+
+uint32_t crc32c_update(uint32_t crc, const void *buf, size_t len) {
+#if defined(__x86_64__)
+    if (crc32c_hw) {
+        const uint8_t *p = buf;
+        if (len >= 3 * CRC32C_STRIDE) {
+            crc = crc32c_sse42_3way(crc, p);
+            p += 3 * CRC32C_STRIDE;
+            len -= 3 * CRC32C_STRIDE;
         }
+        return crc32c_sse42(crc, p, len);
     }
-
-    fprintf(stderr, "ERROR: %s TOO LARGE\n", file->fname);
-    return -1;
+#endif
+    return crc32c_sw(crc, buf, len);
 }
 
+uint32_t crc32c(uint32_t crc, const void *buf, size_t len) {
+    return ~crc32c_update(~crc, buf, len);
+}
 
-void ls(dir_desc dir) {
-    int i = 0;
-    file_desc f;
-    dir_desc d;
+void crc32c_init(void) {
+    uint8_t zeros[2 * CRC32C_STRIDE];
+    uint32_t c;
 
-    printf("--------\n");
-    for (i = 0; i < 190; i++) {
-        if (dir.e[i].bid) {
-            if (dir.e[i].type) {
-                read_block(&f, dir.e[i].bid);
-                printf("%s      %d Byte\n", f.fname, f.fsize);
-            } else {
-                read_block(&d, dir.e[i].bid);
-                printf("%s      %d\n", d.dname, d.dnum);
-            }
+    for (int n = 0; n < 256; n++) {
+        c = n;
+        for (int k = 0; k < 8; k++)
+            c = (c & 1) ? (c >> 1) ^ CRC32C_POLY : c >> 1;
+        crc32c_table[0][n] = c;
+    }
+    for (int n = 0; n < 256; n++) {
+        for (int k = 1; k < 8; k++) {
+            c = crc32c_table[k - 1][n];
+            crc32c_table[k][n] = (c >> 8) ^ crc32c_table[0][c & 0xff];
         }
     }
-    printf("\n");
-}
-
-void dfs(uint16_t bid) {
-    int i;
-    dir_desc d;
-
-    read_block(&d, bid);
-    printf("%s: \n", d.dname);
-    ls(d);
-    for (i = 0; i <  190; i++) {
-        if ((d.e[i].bid) && (!d.e[i].type)) {
-            dfs(d.e[i].bid);
+    /* feeding zeros is linear in the crc register, so it can be tabled */
+    memset(zeros, 0, sizeof(zeros));
+    for (int k = 0; k < 4; k++) {
+        for (int n = 0; n < 256; n++) {
+            crc32c_shift1[k][n] = crc32c_sw((uint32_t)n << (8 * k), zeros, CRC32C_STRIDE);
+            crc32c_shift2[k][n] = crc32c_sw((uint32_t)n << (8 * k), zeros, 2 * CRC32C_STRIDE);
         }
     }
+#if defined(__x86_64__)
+    crc32c_hw = __builtin_cpu_supports("sse4.2");
+#endif
 }
 
 /*--------------------------------------------------------------------------------*/
 
-int do_root(char *name, char *size) {
-    cwd = 6;
-    superblock sb;
-    uint32_t bitmap[BITMAPSIZEWORD];
-    dir_desc root;
-    int i;
+/* Block devices. root picks one of the backends in devices[]:
+ *  mem    anonymous mapping in memory (default)
+ *  file   image file, read and written with pread/pwrite
+ *  async  image file, with readahead served by a pool of I/O threads
+ * All but mem sit behind the buffer cache below.
+ */
+struct bio {
+    int bid, n; /* first block and how many */
+    void (*done)(struct bio *bio); /* called when the read finished */
+    struct bio *next; /* I/O queue link */
+    int slot[RAMAX]; /* cache buffers waiting for the data */
+    uint8_t data[RAMAX * BLOCKSIZE];
+};
 
-    /* initialize superblock */
-    disk = malloc(DISKSIZE);
-    if (disk == NULL) {
-        printf("disk allocation failed\n");
-        exit (1);
-    }
-    memset(bitmap, 0, sizeof(uint32_t) * BITMAPSIZEWORD);
-    set_bit(bitmap, 0); /* block 0 for superblock */
+struct blkdev {
+    char *name;
+    int (*open)(struct blkdev *dev, char *path, int create);
+    void (*read)(struct blkdev *dev, void *data, int bid, int n);
+    void (*write)(struct blkdev *dev, void *data, int bid, int n);
+    void (*trim)(struct blkdev *dev, int bid, int n);
+    void (*submit)(struct blkdev *dev, struct bio *bio); /* NULL: read right away */
+    void (*close)(struct blkdev *dev);
+    int cached; /* goes through the buffer cache */
+    void *mem; /* mem: the mapping */
+    int fd; /* file, async: the image */
+    struct ioq *q; /* async: the request queue */
+};
 
-    sb.fs_size = DISKSIZE;
+/* mem: pages are only committed when written, and trimmed pages are given
+ * back to the OS and read as zeros afterwards */
+int mem_open(struct blkdev *dev, char *path, int create) {
+    dev->mem = mmap(NULL, DISKSIZE, PROT_READ | PROT_WRITE,
+                    MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    return dev->mem == MAP_FAILED ? -1 : 0;
+}
 
-    /* block 1-5 for bitmap */
-    for (i = 1; i <= 5; i++)
-        set_bit(bitmap, i);
+void mem_read(struct blkdev *dev, void *data, int bid, int n) {
+    memcpy(data, (uint8_t *)dev->mem + (size_t)bid * BLOCKSIZE, (size_t)n * BLOCKSIZE);
+}
 
-    /* block 6 for root directory */
-    memset(&root, 0, sizeof(dir_desc));
-    strcpy(root.dname, "root");
-    set_bit(bitmap, 6);
-    root.parbid = 6;
-    sb.root_bid = 6;
+void mem_write(struct blkdev *dev, void *data, int bid, int n) {
+    memcpy((uint8_t *)dev->mem + (size_t)bid * BLOCKSIZE, data, (size_t)n * BLOCKSIZE);
+}
 
-    /* write descriptors to blocks*/
-    write_block(&sb, 0);
-    for (i = 0; i < 5; i++)
-        write_block(&bitmap[i * BLOCKSIZEWORD], i + 1);
-    //print_block(disk, 1);
-    write_block(&root, 6);
+void mem_trim(struct blkdev *dev, int bid, int n) {
+    madvise((uint8_t *)dev->mem + (size_t)bid * BLOCKSIZE, (size_t)n * BLOCKSIZE, MADV_DONTNEED);
+}
 
-    printf("\n%s\\>", root.dname);
+void mem_close(struct blkdev *dev) {
+    munmap(dev->mem, DISKSIZE);
+}
 
-    if (debug) printf("%s\n", __func__);
+/* file: a sparse image file; trimmed ranges become holes. Without create
+ * the image must exist already. */
+int file_open(struct blkdev *dev, char *path, int create) {
+    dev->fd = open(path, O_RDWR | (create ? O_CREAT : 0), 0644);
+    if (dev->fd < 0)
+        return -1;
+    if (create && ftruncate(dev->fd, DISKSIZE) == -1) {
+        close(dev->fd);
+        return -1;
+    }
     return 0;
 }
 
-int do_print(char *name, char *size) {
-    dir_desc cwdd;
+void file_read(struct blkdev *dev, void *data, int bid, int n) {
+    if (pread(dev->fd, data, (size_t)n * BLOCKSIZE, (off_t)bid * BLOCKSIZE) != n * BLOCKSIZE)
+        fprintf(stderr, "ERROR: READ OF BLOCK %d FAILED\n", bid);
+}
 
-    read_block(&cwdd, cwd);
-    dfs(cwd);
+void file_write(struct blkdev *dev, void *data, int bid, int n) {
+    if (pwrite(dev->fd, data, (size_t)n * BLOCKSIZE, (off_t)bid * BLOCKSIZE) != n * BLOCKSIZE)
+        fprintf(stderr, "ERROR: WRITE OF BLOCK %d FAILED\n", bid);
+}
 
-    printf("\n%s\\>", cwdd.dname);
-    if (debug) printf("%s\n", __func__);
-    return 0;
+void file_trim(struct blkdev *dev, int bid, int n) {
+    fallocate(dev->fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+              (off_t)bid * BLOCKSIZE, (off_t)n * BLOCKSIZE);
 }
 
-int do_chdir(char *name, char *size) {
+void file_close(struct blkdev *dev) {
+    fsync(dev->fd);
+    close(dev->fd);
+}
 
-    uint32_t bitmap[BITMAPSIZEWORD];
-    dir_desc cwdb, todb;
-    read_block( &cwdb, cwd);
-    for (int i = 0; i < 5; i++) {
-        read_block(&bitmap[i * BLOCKSIZEWORD], i + 1);
-    }
-    if (!strcmp(name, "..")) {
-        cwd = cwdb.parbid;
-        read_block( &cwdb, cwd);
-    } else {
-        int find_dir = 0;
-        for (int i = 0; i < 190; i++) {
-            if (cwdb.e[i].bid > 0) {
-                int t_a = cwdb.e[i].bid / 32;
-                int t_b = cwdb.e[i].bid % 32;
-                if ((bitmap[t_a] & (1 << t_b))) {
-                    //            printf("block %d is under this directory \n", cwdb.e[i].bid);
-                    if (cwdb.e[i].type == 0) {
-                        read_block( &todb, cwdb.e[i].bid);
-                        //              printf("it is a directory (%s)\n", todb.dname);
-                        if (!strcmp(todb.dname, name)) {
-                            find_dir = 1;
-                            cwd = cwdb.e[i].bid;
-                            read_block( &cwdb, cwd);
-                        }
-                    }
-                }
-            }
-        }
-        if (find_dir == 0) {
-            printf("Directory '%s' not found.\n", name);
+/* async: the file backend plus a queue of reads served by up to IOTHREADS
+ * threads; each open device has its own queue */
+struct ioq {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    struct bio *head, *tail;
+    int stop;
+    int fd; /* the image, read by the threads */
+    int nthreads; /* threads that started */
+    pthread_t thread[IOTHREADS];
+};
+
+void *io_worker(void *arg) {
+    struct ioq *q = arg;
+    struct blkdev d = { .fd = q->fd };
+    struct bio *bio;
+
+    for (;;) {
+        pthread_mutex_lock(&q->lock);
+        while (q->head == NULL && !q->stop)
+            pthread_cond_wait(&q->cond, &q->lock);
+        bio = q->head;
+        if (bio != NULL) {
+            q->head = bio->next;
+            if (q->head == NULL)
+                q->tail = NULL;
         }
+        pthread_mutex_unlock(&q->lock);
+        if (bio == NULL) /* stopping and nothing left */
+            return NULL;
+
+        file_read(&d, bio->data, bio->bid, bio->n);
+        bio->done(bio);
     }
-    printf("\n%s\\>", cwdb.dname);
+}
 
-    //    printf("CD %d = (%d, %d)\n", to_dir, to_dir_block, to_dir_bit);
+int async_open(struct blkdev *dev, char *path, int create) {
+    struct ioq *q;
 
-    if (debug) printf("%s\n", __func__);
+    if (file_open(dev, path, create) == -1)
+        return -1;
+    q = calloc(1, sizeof(struct ioq));
+    if (q == NULL) {
+        file_close(dev);
+        return -1;
+    }
+    pthread_mutex_init(&q->lock, NULL);
+    pthread_cond_init(&q->cond, NULL);
+    q->fd = dev->fd;
+    while (q->nthreads < IOTHREADS &&
+           pthread_create(&q->thread[q->nthreads], NULL, io_worker, q) == 0)
+        q->nthreads++;
+    if (q->nthreads == 0) {
+        free(q);
+        file_close(dev);
+        return -1;
+    }
+    dev->q = q;
     return 0;
+}
 
+void async_submit(struct blkdev *dev, struct bio *bio) {
+    struct ioq *q = dev->q;
+
+    bio->next = NULL;
+    pthread_mutex_lock(&q->lock);
+    if (q->tail != NULL)
+        q->tail->next = bio;
+    else
+        q->head = bio;
+    q->tail = bio;
+    pthread_cond_signal(&q->cond);
+    pthread_mutex_unlock(&q->lock);
 }
 
-int do_mkdir(char *name, char *size) {
-    uint32_t bitmap[BITMAPSIZEWORD];
-    int empty_block = 0;
-    int i;
-    dir_desc current_dir;
+void async_close(struct blkdev *dev) {
+    struct ioq *q = dev->q;
+
+    pthread_mutex_lock(&q->lock);
+    q->stop = 1;
+    pthread_cond_broadcast(&q->cond);
+    pthread_mutex_unlock(&q->lock);
+    for (int i = 0; i < q->nthreads; i++)
+        pthread_join(q->thread[i], NULL);
+    free(q);
+    dev->q = NULL;
+    file_close(dev);
+}
 
-    //find an open block
-    for (i = 1; i <= 5; i++) {
-        read_block(bitmap, i);
-        empty_block = empty_bid(bitmap);
-        if (empty_block != 0) //if empty block is found, break
-            break;
-    }
+struct blkdev devices[] = {
+    { "mem"  , mem_open  , mem_read , mem_write , mem_trim , NULL        , mem_close  , 0, NULL, -1, NULL },
+    { "file" , file_open , file_read, file_write, file_trim, NULL        , file_close , 1, NULL, -1, NULL },
+    { "async", async_open, file_read, file_write, file_trim, async_submit, async_close, 1, NULL, -1, NULL },
+    { NULL, NULL, NULL, NULL, NULL, NULL, NULL, 0, NULL, -1, NULL }  // end marker, do not remove
+};
 
-    set_bit(bitmap, empty_block); //set bit in bitmap to 1
-    dir_desc new_dir_desc; //new dir_desc
-    memset(&new_dir_desc, 0, sizeof(dir_desc));
-    strcpy(new_dir_desc.dname, name); //set dir_desc name
-    new_dir_desc.dnum = 0; //set number of directories/files
-    new_dir_desc.parbid = cwd; //set parent bid
+/*--------------------------------------------------------------------------------*/
 
-    write_block(&new_dir_desc, empty_block); //write new dir_desc to empty block
-    write_block(bitmap, i); //write updated bitmap to bitmap block
+/* Buffer cache: NBUF blocks with CLOCK eviction and write-back. Dirty
+ * buffers reach the device when they are evicted or on bsync().
+ * Device I/O runs without the cache lock: the buffers involved are marked
+ * busy, which keeps them from being evicted or used until it finishes.
+ */
+struct buf {
+    int bid; /* -1 when empty */
+    uint8_t ref; /* CLOCK reference bit */
+    uint8_t dirty; /* newer than the device */
+    uint8_t busy; /* read or write-back in flight */
+    uint8_t data[BLOCKSIZE];
+} bcache[NBUF];
+
+int16_t bslot[BLOCKNUM]; /* buffer holding each block, -1 if none */
+int bhand = 0; /* CLOCK hand */
+pthread_mutex_t bcache_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t bcache_cond = PTHREAD_COND_INITIALIZER;
+
+struct {
+    long hits, misses, readahead, writeback;
+} bstats;
+
+void binit(void) {
+    for (int i = 0; i < NBUF; i++) {
+        bcache[i].bid = -1;
+        bcache[i].ref = bcache[i].dirty = bcache[i].busy = 0;
+    }
+    for (int i = 0; i < BLOCKNUM; i++)
+        bslot[i] = -1;
+    bhand = 0;
+    memset(&bstats, 0, sizeof(bstats));
+}
 
-    read_block(&current_dir, cwd); //read current_dir
-    update_parent(&current_dir, 0, empty_block); //update parent
-    current_dir.dnum++;
-    //printf("%d, %d", current_dir.e[0].bid, current_dir.e[0].type); //check
-    write_block(&current_dir, cwd); //write back to block
+/* pick a buffer to reuse, writing it back if dirty; cache lock held, but
+ * dropped during the write */
+int bvictim(void) {
+    struct buf *b;
+    int slot, spins = 0;
+
+    for (;;) {
+        slot = bhand;
+        b = &bcache[slot];
+        bhand = (bhand + 1) % NBUF;
+        if (++spins > 2 * NBUF) { /* everything is busy */
+            pthread_cond_wait(&bcache_cond, &bcache_lock);
+            spins = 0;
+        }
+        if (b->busy)
+            continue;
+        if (b->ref) {
+            b->ref = 0;
+            continue;
+        }
+        if (b->dirty) {
+            b->busy = 1;
+            b->dirty = 0;
+            pthread_mutex_unlock(&bcache_lock);
+            dev->write(dev, b->data, b->bid, 1);
+            pthread_mutex_lock(&bcache_lock);
+            b->busy = 0;
+            bstats.writeback++;
+            pthread_cond_broadcast(&bcache_cond);
+        }
+        if (b->bid >= 0)
+            bslot[b->bid] = -1;
+        b->bid = -1;
+        return slot;
+    }
+}
 
-    ls(current_dir);
+/* buffer for bid, waiting out I/O on it; *fresh is set when the buffer
+ * was just assigned and holds no data yet. Cache lock held.
+ */
+int bget(int bid, int *fresh) {
+    int slot;
+
+    for (;;) {
+        while ((slot = bslot[bid]) >= 0 && bcache[slot].busy)
+            pthread_cond_wait(&bcache_cond, &bcache_lock);
+        if (slot >= 0) {
+            *fresh = 0;
+            return slot;
+        }
+        slot = bvictim();
+        if (bslot[bid] < 0) /* nobody loaded it while bvictim waited */
+            break;
+    }
+    bcache[slot].bid = bid;
+    bslot[bid] = slot;
+    *fresh = 1;
+    return slot;
+}
 
-    printf("\n%s\\>", current_dir.dname);
+void bread(void *data, int bid) {
+    struct buf *b;
+    int slot, fresh;
+
+    pthread_mutex_lock(&bcache_lock);
+    slot = bget(bid, &fresh);
+    b = &bcache[slot];
+    if (fresh) {
+        b->busy = 1;
+        pthread_mutex_unlock(&bcache_lock);
+        dev->read(dev, b->data, bid, 1);
+        pthread_mutex_lock(&bcache_lock);
+        b->busy = 0;
+        bstats.misses++;
+        pthread_cond_broadcast(&bcache_cond);
+    } else {
+        bstats.hits++;
+    }
+    b->ref = 1;
+    memcpy(data, b->data, BLOCKSIZE);
+    pthread_mutex_unlock(&bcache_lock);
+}
 
-    if (debug) printf("%s\n", __func__);
-    return 0;
+void bwrite(void *data, int bid) {
+    struct buf *b;
+    int slot, fresh;
+
+    pthread_mutex_lock(&bcache_lock);
+    slot = bget(bid, &fresh);
+    b = &bcache[slot];
+    b->ref = 1;
+    b->dirty = 1;
+    memcpy(b->data, data, BLOCKSIZE);
+    pthread_mutex_unlock(&bcache_lock);
 }
 
-int do_rmdir(char *name, char *size) {
+void bio_done(struct bio *bio) {
+    pthread_mutex_lock(&bcache_lock);
+    for (int k = 0; k < bio->n; k++) {
+        memcpy(bcache[bio->slot[k]].data, &bio->data[k * BLOCKSIZE], BLOCKSIZE);
+        bcache[bio->slot[k]].busy = 0;
+    }
+    pthread_cond_broadcast(&bcache_cond);
+    pthread_mutex_unlock(&bcache_lock);
+    free(bio);
+}
 
+/* start reading the blocks in bids that are not cached yet; runs of
+ * consecutive blocks become one request */
+void bprefetch(uint16_t *bids, int n) {
+    struct bio *list = NULL, *bio = NULL;
+    int slot;
 
-    uint32_t bitmap[BITMAPSIZEWORD];
-    dir_desc cwdb, rmdb;
-    read_block( &cwdb, cwd);
-    for (int i = 0; i < 5; i++) {
-        read_block(&bitmap[i * BLOCKSIZEWORD], i + 1);
+    pthread_mutex_lock(&bcache_lock);
+    for (int i = 0; i < n; i++) {
+        if (bids[i] == 0 || bslot[bids[i]] >= 0) {
+            bio = NULL;
+            continue;
+        }
+        if (bio == NULL || bids[i] != bio->bid + bio->n || bio->n == RAMAX) {
+            bio = malloc(sizeof(struct bio));
+            if (bio == NULL)
+                break;
+            bio->bid = bids[i];
+            bio->n = 0;
+            bio->done = bio_done;
+            bio->next = list;
+            list = bio;
+        }
+        slot = bvictim();
+        if (bslot[bids[i]] >= 0) /* loaded while bvictim waited */
+            continue;
+        bcache[slot].bid = bids[i];
+        bcache[slot].busy = 1;
+        bslot[bids[i]] = slot;
+        bio->slot[bio->n++] = slot;
+        bstats.readahead++;
+    }
+    pthread_mutex_unlock(&bcache_lock);
+
+    while (list != NULL) {
+        bio = list;
+        list = bio->next;
+        if (dev->submit != NULL) {
+            dev->submit(dev, bio);
+        } else {
+            dev->read(dev, bio->data, bio->bid, bio->n);
+            bio->done(bio);
+        }
     }
+}
 
-    int tcwd = cwd;
-    int find_dir = 0;
-    for (int i = 0; i < 190; i++) {
-        if (cwdb.e[i].bid > 0) {
-            int t_a = cwdb.e[i].bid / 32;
-            int t_b = cwdb.e[i].bid % 32;
-            if ((bitmap[t_a] & (1 << t_b))) {
-                //            printf("block %d is under this directory \n", cwdb.e[i].bid);
-                if (cwdb.e[i].type == 0) {
-                    read_block( &rmdb, cwdb.e[i].bid);
-                }
-                if (((!strcmp(rmdb.dname, name)) && (cwdb.e[i].type == 0)) || (!strcmp(name, "-all"))) {
-                    if (cwdb.e[i].type == 0) {
-                        find_dir = 1;
-                        cwd = cwdb.e[i].bid;
-                        char *tname = "-all";
-                        do_rmdir(tname, NULL);
-                        cwd = tcwd;
-                    }
-                    for (int i = 0; i < 5; i++) {
-                        read_block(&bitmap[i * BLOCKSIZEWORD], i + 1);
-                    }
-                    clear_bit(bitmap, cwdb.e[i].bid);
-                    for (int i = 0; i < 5; i++) {
-                        write_block(&bitmap[i * BLOCKSIZEWORD], i + 1);
-                    }
-                    cwdb.e[i].bid = 0;
-                }
-            }
+int bslot_cmp(const void *a, const void *b) {
+    return bcache[*(const int *)a].bid - bcache[*(const int *)b].bid;
+}
+
+/* write every dirty buffer back, runs of consecutive blocks in one request */
+void bsync(void) {
+    static int dirty[NBUF];
+    static uint8_t run[RAMAX * BLOCKSIZE];
+    int n = 0, i, k;
+
+    pthread_mutex_lock(&bcache_lock);
+    for (i = 0; i < NBUF; i++) {
+        if (bcache[i].dirty && !bcache[i].busy) {
+            bcache[i].busy = 1;
+            bcache[i].dirty = 0;
+            dirty[n++] = i;
         }
     }
-    if ((find_dir == 0) && (strcmp(name, "-all"))) {
-        printf("Directory '%s' not found.\n", name);
+    bstats.writeback += n;
+    pthread_mutex_unlock(&bcache_lock);
+
+    /* busy buffers keep their block and data, so no lock is needed here */
+    qsort(dirty, n, sizeof(int), bslot_cmp);
+    for (i = 0; i < n; i += k) {
+        for (k = 0; i + k < n && k < RAMAX &&
+             bcache[dirty[i + k]].bid == bcache[dirty[i]].bid + k; k++)
+            memcpy(&run[k * BLOCKSIZE], bcache[dirty[i + k]].data, BLOCKSIZE);
+        dev->write(dev, run, bcache[dirty[i]].bid, k);
     }
 
-    write_block( &cwdb, cwd);
-    ls(cwdb);
-    //    for (int i=0; i<BITMAPSIZEWORD; i++) {
-    //        printf("%d", bitmap[0]);
-    //    }
+    pthread_mutex_lock(&bcache_lock);
+    for (i = 0; i < n; i++)
+        bcache[dirty[i]].busy = 0;
+    pthread_cond_broadcast(&bcache_cond);
+    pthread_mutex_unlock(&bcache_lock);
+}
 
-    printf("\n%s\\>", cwdb.dname);
-    if (debug) printf("%s\n", __func__);
+/* forget cached copies of freed blocks so they are never written back */
+void binval(int bid, int n) {
+    int slot;
+
+    pthread_mutex_lock(&bcache_lock);
+    for (int b = bid; b < bid + n; b++) {
+        slot = bslot[b];
+        if (slot >= 0 && !bcache[slot].busy) {
+            bcache[slot].bid = -1;
+            bcache[slot].dirty = 0;
+            bslot[b] = -1;
+        }
+    }
+    pthread_mutex_unlock(&bcache_lock);
+}
+
+/*--------------------------------------------------------------------------------*/
+
+/* Transactions: between begin and commit every block written goes into a
+ * private dirty set instead of the device, and reads look there first.
+ * commit writes each block of the set once, abort throws the set away.
+ */
+struct {
+    int active;
+    int failed; /* a block was dropped, only abort is left */
+    int n, cap; /* blocks in the set, room for */
+    int *bid;
+    uint8_t *data; /* block i of the set is data[i * BLOCKSIZE] */
+    int slot[BLOCKNUM]; /* index of each block in the set, -1 if none */
+    int cwd; /* cwd at begin, restored by abort */
+    int trim_first, trim_last; /* freed extent to trim at commit */
+} txn;
+
+/* put a block into the dirty set; -1 when out of memory */
+int txn_put(void *data, int bid) {
+    int i = txn.slot[bid];
+
+    if (i < 0) {
+        if (txn.n == txn.cap) {
+            int cap = txn.cap ? 2 * txn.cap : 64;
+            int *nbid = realloc(txn.bid, cap * sizeof(int));
+            if (nbid == NULL)
+                return -1;
+            txn.bid = nbid;
+            uint8_t *ndata = realloc(txn.data, (size_t)cap * BLOCKSIZE);
+            if (ndata == NULL)
+                return -1;
+            txn.data = ndata;
+            txn.cap = cap;
+        }
+        i = txn.n++;
+        txn.bid[i] = bid;
+        txn.slot[bid] = i;
+    }
+    memcpy(&txn.data[(size_t)i * BLOCKSIZE], data, BLOCKSIZE);
     return 0;
 }
 
-int do_mvdir(char *name, char *size) {
+/* inside a transaction a block that does not fit the dirty set is dropped,
+ * never written through; the transaction is then failed, see txn_check() */
+void write_block(void *data, int bid) {
+    if (txn.active) {
+        if (txn.failed || txn_put(data, bid) == -1)
+            txn.failed = 1;
+        return;
+    }
+    if (dev->cached)
+        bwrite(data, bid);
+    else
+        dev->write(dev, data, bid, 1);
+}
 
-    uint32_t bitmap[BITMAPSIZEWORD];
-    dir_desc cwdb, mvdb;
-    read_block( &cwdb, cwd);
-    for (int i = 0; i < 5; i++) {
-        read_block(&bitmap[i * BLOCKSIZEWORD], i + 1);
+void read_block(void *data, int bid) {
+    if (txn.active && txn.slot[bid] >= 0) {
+        memcpy(data, &txn.data[(size_t)txn.slot[bid] * BLOCKSIZE], BLOCKSIZE);
+        return;
     }
+    if (dev->cached)
+        bread(data, bid);
+    else
+        dev->read(dev, data, bid, 1);
+}
+
+/* write back what is cached and let go of the device */
+void close_disk(void) {
+    if (dev == NULL)
+        return;
+    if (dev->cached)
+        bsync();
+    dev->close(dev);
+    dev = NULL;
+}
+
+/* Reading a file's blocks in order grows a readahead window (up to RAMAX)
+ * over its block list; the next window is requested when half of the
+ * current one has been consumed. Any other access resets it.
+ */
+struct readahead {
+    int next; /* index in the block list expected next */
+    int window; /* blocks to request ahead */
+    int until; /* blocks before this index are already requested */
+};
+
+void read_file_block(file_desc *file, int i, void *data, struct readahead *ra) {
+    int from, n;
+
+    if (dev->cached) {
+        if (i != ra->next) {
+            ra->window = 0;
+            ra->until = 0;
+        }
+        if (ra->until - i <= ra->window / 2) {
+            ra->window = ra->window == 0 ? 4 : (ra->window * 2 > RAMAX ? RAMAX : ra->window * 2);
+            from = ra->until > i + 1 ? ra->until : i + 1;
+            n = from + ra->window > 382 ? 382 - from : ra->window;
+            if (n > 0)
+                bprefetch(&file->bid[from], n);
+            ra->until = from + (n > 0 ? n : 0);
+        }
+        ra->next = i + 1;
+    }
+    read_block(data, file->bid[i]);
+}
+
+/* checksum of a descriptor block, stored in its last 4 Byte */
+uint32_t meta_csum(void *data, int bid) {
+    uint32_t id = bid;
+
+    return crc32c(crc32c(0, &id, 4), data, BLOCKSIZE - 4);
+}
+
+/* descriptors (superblock, group, directory, file) go through these */
+void write_meta(void *data, int bid) {
+    uint32_t csum = meta_csum(data, bid);
+
+    memcpy((uint8_t *)data + BLOCKSIZE - 4, &csum, 4);
+    write_block(data, bid);
+}
+
+int read_meta(void *data, int bid) {
+    uint32_t csum;
+
+    read_block(data, bid);
+    memcpy(&csum, (uint8_t *)data + BLOCKSIZE - 4, 4);
+    if (csum != meta_csum(data, bid)) {
+        fprintf(stderr, "ERROR: BAD CHECKSUM IN BLOCK %d\n", bid);
+        return -1;
+    }
+    return 0;
+}
+
+/* a group descriptor and its bitmap block; the bitmap checksum lives in
+ * the descriptor */
+int read_group(int g, group_desc *gd, uint32_t *bitmap) {
+    if (read_meta(gd, GDTBID + g) == -1)
+        return -1;
+    read_block(bitmap, gd->bitmap_bid);
+    if (gd->bitmap_csum != crc32c(0, bitmap, BLOCKSIZE)) {
+        fprintf(stderr, "ERROR: BAD CHECKSUM IN BITMAP BLOCK %d\n", gd->bitmap_bid);
+        return -1;
+    }
+    return 0;
+}
+
+void write_group(int g, group_desc *gd, uint32_t *bitmap) {
+    gd->bitmap_csum = crc32c(0, bitmap, BLOCKSIZE);
+    write_block(bitmap, gd->bitmap_bid);
+    write_meta(gd, GDTBID + g);
+}
+
+/* read the bitmap blocks of all groups into one array */
+int read_bitmaps(uint32_t *bitmap) {
+    group_desc gd;
+
+    for (int g = 0; g < NGROUPS; g++) {
+        if (read_group(g, &gd, &bitmap[g * BLOCKSIZEWORD]) == -1)
+            return -1;
+    }
+    return 0;
+}
+
+void update_parent(dir_desc *update, int file_or_dir, int bid) {
+    for (int i = 0; i < 190; i++) {
+        if (update->e[i].bid == 0) {
+            update->e[i].bid = bid;
+            update->e[i].type = file_or_dir;
+            return;
+        }
+    }
+
+    fprintf(stderr, "ERROR: NOT ENOUGH SPACE IN DIRECTORY\n");
+}
+
+/*--------------------------------------------------------------------------------*/
+
+/* Allocation groups: group g owns blocks g * BLOCKSPERGROUP .. and keeps its
+ * own bitmap block (1 + g), free counter and descriptor block (GDTBID + g).
+ * Each group has its own lock, so threads allocating in different groups
+ * never wait on each other.
+ */
+struct {
+    pthread_mutex_t m;
+} __attribute__((aligned(64))) group_lock[NGROUPS]; /* one cache line each */
+
+int group_of(int bid) {
+    return bid / BLOCKSPERGROUP;
+}
+
+/* take a free block from group g, as close after goal as possible; 0 if full */
+uint16_t group_alloc(int g, int goal) {
+    uint32_t bitmap[BLOCKSIZEWORD];
+    group_desc gd;
+    int n = -1;
+
+    pthread_mutex_lock(&group_lock[g].m);
+    if (read_group(g, &gd, bitmap) == 0 && gd.free_blocks > 0) {
+        if (group_of(goal) != g)
+            goal = gd.first_bid;
+        n = empty_bit(bitmap, BLOCKSIZEWORD, (goal - gd.first_bid) / 32);
+        if (n >= 0) {
+            set_bit(bitmap, n);
+            gd.free_blocks--;
+            write_group(g, &gd, bitmap);
+        }
+    }
+    pthread_mutex_unlock(&group_lock[g].m);
+
+    if (n < 0)
+        return 0;
+    if (debug) printf("group %d: allocated %d\n", g, gd.first_bid + n);
+    return gd.first_bid + n;
+}
+
+int group_free_blocks(int g) {
+    group_desc gd;
+
+    pthread_mutex_lock(&group_lock[g].m);
+    if (read_meta(&gd, GDTBID + g) == -1)
+        gd.free_blocks = 0;
+    pthread_mutex_unlock(&group_lock[g].m);
+    return gd.free_blocks;
+}
+
+/* blocks of a file go next to goal; when that group is full, spill over
+ * into the following groups in order. 0 means the file system is full.
+ */
+uint16_t alloc_block(int goal) {
+    int g0 = group_of(goal);
+    uint16_t bid;
+
+    for (int k = 0; k < NGROUPS; k++) {
+        bid = group_alloc((g0 + k) % NGROUPS, goal);
+        if (bid != 0)
+            return bid;
+    }
+    return 0;
+}
+
+/* a new directory goes into its parent's group; when that group is full,
+ * spill over into the group with the most free blocks so the new subtree
+ * has room to grow.
+ */
+uint16_t alloc_dir_block(int parent) {
+    uint16_t bid;
+    int best = -1, most = 0, nfree;
+
+    bid = group_alloc(group_of(parent), parent);
+    if (bid != 0)
+        return bid;
+    for (int g = 0; g < NGROUPS; g++) {
+        nfree = group_free_blocks(g);
+        if (nfree > most) {
+            most = nfree;
+            best = g;
+        }
+    }
+    if (best < 0)
+        return 0;
+    return alloc_block(best * BLOCKSPERGROUP);
+}
+
+void free_block(int bid) {
+    uint32_t bitmap[BLOCKSIZEWORD];
+    group_desc gd;
+    int g = group_of(bid);
+
+    pthread_mutex_lock(&group_lock[g].m);
+    if (read_group(g, &gd, bitmap) == 0 && test_bit(bitmap, bid - gd.first_bid)) {
+        clear_bit(bitmap, bid - gd.first_bid);
+        gd.free_blocks++;
+        write_group(g, &gd, bitmap);
+    }
+    pthread_mutex_unlock(&group_lock[g].m);
+    if (debug) printf("group %d: freed %d\n", g, bid);
+}
+
+/* After a large extent is freed, the pages in [first, last] whose blocks
+ * are all free are trimmed: the mem backend gives them back to the OS and
+ * the file backend punches a hole. The group lock is held so that no block
+ * in those pages can be allocated in between.
+ */
+void disk_trim(int first, int last) {
+    uint32_t bitmap[BLOCKSIZEWORD];
+    group_desc gd;
+    int per_page = sysconf(_SC_PAGESIZE) / BLOCKSIZE;
+    int lo, hi, run = -1;
+
+    if ((last - first + 1) * BLOCKSIZE < TRIMSIZE || per_page < 1)
+        return;
+    if (txn.active) { /* an abort would need the blocks back */
+        if (txn.trim_first > first)
+            txn.trim_first = first;
+        if (txn.trim_last < last)
+            txn.trim_last = last;
+        return;
+    }
+
+    for (int g = group_of(first); g <= group_of(last); g++) {
+        pthread_mutex_lock(&group_lock[g].m);
+        if (read_group(g, &gd, bitmap) == 0) {
+            lo = first > gd.first_bid ? first : gd.first_bid;
+            hi = last < gd.first_bid + gd.nblocks - 1 ? last : gd.first_bid + gd.nblocks - 1;
+            lo = (lo + per_page - 1) / per_page * per_page; /* whole pages only */
+            run = -1;
+            for (int p = lo; ; p += per_page) {
+                int free = p + per_page - 1 <= hi; /* page inside the range */
+                for (int b = p; free && b < p + per_page; b++)
+                    free = !test_bit(bitmap, b - gd.first_bid);
+                if (free) {
+                    if (run < 0)
+                        run = p;
+                    continue;
+                }
+                if (run >= 0) {
+                    if (dev->cached)
+                        binval(run, p - run);
+                    dev->trim(dev, run, p - run);
+                    if (debug) printf("trimmed blocks %d - %d\n", run, p - 1);
+                    run = -1;
+                }
+                if (p + per_page - 1 > hi)
+                    break;
+            }
+        }
+        pthread_mutex_unlock(&group_lock[g].m);
+    }
+}
+
+/*--------------------------------------------------------------------------------*/
+
+/* Deduplication. With dedup on, every data block written is hashed with
+ * xxh64 and looked up in the fingerprint table; a block with the same
+ * content is shared instead of written, and its reference counter goes up.
+ * Freeing a shared block only drops a reference. Both tables live on disk
+ * and are created by the first 'dedup on'.
+ */
+#define XXH_P1 11400714785074694791ULL
+#define XXH_P2 14029467366897019727ULL
+#define XXH_P3 1609587929392839161ULL
+#define XXH_P4 9650029242287828579ULL
+#define XXH_P5 2870177450012600261ULL
+
+uint64_t rotl64(uint64_t x, int r) {
+    return (x << r) | (x >> (64 - r));
+}
+
+uint64_t xxh64_round(uint64_t acc, uint64_t input) {
+    return rotl64(acc + input * XXH_P2, 31) * XXH_P1;
+}
+
+uint64_t xxh64_merge(uint64_t h, uint64_t v) {
+    return (h ^ xxh64_round(0, v)) * XXH_P1 + XXH_P4;
+}
+
+/* four independent lanes over 32 Byte stripes, which compilers vectorize */
+uint64_t xxh64(const void *buf, size_t len, uint64_t seed) {
+    const uint8_t *p = buf, *end = p + len;
+    uint64_t h, v[4], k;
+    uint32_t k32;
+
+    if (len >= 32) {
+        v[0] = seed + XXH_P1 + XXH_P2;
+        v[1] = seed + XXH_P2;
+        v[2] = seed;
+        v[3] = seed - XXH_P1;
+        for (; p + 32 <= end; p += 32) {
+            for (int i = 0; i < 4; i++) {
+                memcpy(&k, p + 8 * i, 8);
+                v[i] = xxh64_round(v[i], k);
+            }
+        }
+        h = rotl64(v[0], 1) + rotl64(v[1], 7) + rotl64(v[2], 12) + rotl64(v[3], 18);
+        for (int i = 0; i < 4; i++)
+            h = xxh64_merge(h, v[i]);
+    } else {
+        h = seed + XXH_P5;
+    }
+    h += len;
+    for (; p + 8 <= end; p += 8) {
+        memcpy(&k, p, 8);
+        h = rotl64(h ^ xxh64_round(0, k), 27) * XXH_P1 + XXH_P4;
+    }
+    if (p + 4 <= end) {
+        memcpy(&k32, p, 4);
+        h = rotl64(h ^ (k32 * XXH_P1), 23) * XXH_P2 + XXH_P3;
+        p += 4;
+    }
+    for (; p < end; p++)
+        h = rotl64(h ^ (*p * XXH_P5), 11) * XXH_P1;
+    h ^= h >> 33;
+    h *= XXH_P2;
+    h ^= h >> 29;
+    h *= XXH_P3;
+    h ^= h >> 32;
+    return h;
+}
+
+/* extra references of a block; 0 without a reference table */
+int ref_get(superblock *sb, int bid) {
+    ref_block r;
+
+    if (sb->ref_bid == 0 || read_meta(&r, sb->ref_bid + bid / 510) == -1)
+        return 0;
+    return r.refs[bid % 510];
+}
+
+/* -1 if the count could not be read, and nothing changed */
+int ref_add(superblock *sb, int bid, int delta) {
+    ref_block r;
+
+    if (read_meta(&r, sb->ref_bid + bid / 510) == -1)
+        return -1;
+    r.refs[bid % 510] += delta;
+    write_meta(&r, sb->ref_bid + bid / 510);
+    return 0;
+}
+
+void ddt_get(superblock *sb, int k, struct ddt_entry *e) {
+    ddt_block d;
+
+    if (read_meta(&d, sb->ddt_bid + k / 63) == -1)
+        memset(&d, 0, sizeof(ddt_block));
+    *e = d.e[k % 63];
+}
+
+void ddt_set(superblock *sb, int k, struct ddt_entry *e) {
+    ddt_block d;
+
+    if (read_meta(&d, sb->ddt_bid + k / 63) == -1)
+        memset(&d, 0, sizeof(ddt_block));
+    d.e[k % 63] = *e;
+    write_meta(&d, sb->ddt_bid + k / 63);
+}
+
+/* block already holding data, 0 if none; *slot is where data would go */
+int ddt_find(superblock *sb, uint64_t hash, void *data, int *slot) {
+    struct ddt_entry e;
+    uint8_t b[BLOCKSIZE];
+
+    for (int k = hash % NDDT; ; k = (k + 1) % NDDT) {
+        ddt_get(sb, k, &e);
+        if (e.bid == 0) {
+            *slot = k;
+            return 0;
+        }
+        if (e.hash == hash) {
+            read_block(b, e.bid);
+            if (memcmp(b, data, BLOCKSIZE) == 0) {
+                *slot = k;
+                return e.bid;
+            }
+        }
+    }
+}
+
+/* drop the fingerprint of bid, moving later entries of the probe chain
+ * back so that no tombstones are needed */
+void ddt_forget(superblock *sb, int bid) {
+    struct ddt_entry e, empty = { 0, 0 };
+    uint8_t b[BLOCKSIZE];
+    uint64_t hash;
+    int i, j, home;
+
+    read_block(b, bid);
+    hash = xxh64(b, BLOCKSIZE, 0);
+    for (i = hash % NDDT; ; i = (i + 1) % NDDT) {
+        ddt_get(sb, i, &e);
+        if (e.bid == 0)
+            return; /* never fingerprinted */
+        if (e.bid == bid)
+            break;
+    }
+    for (j = (i + 1) % NDDT; ; j = (j + 1) % NDDT) {
+        ddt_get(sb, j, &e);
+        if (e.bid == 0)
+            break;
+        home = e.hash % NDDT;
+        /* e may move back to i only if i lies between its home and j */
+        if ((i <= j) ? (home <= i || home > j) : (home <= i && home > j)) {
+            ddt_set(sb, i, &e);
+            i = j;
+        }
+    }
+    ddt_set(sb, i, &empty);
+    sb->ddt_used--;
+    write_meta(sb, 0);
+}
+
+/* free a data block, or drop one reference if it is shared */
+void free_data_block(int bid) {
+    superblock sb;
+
+    if (read_meta(&sb, 0) == 0 && sb.ref_bid != 0) {
+        if (ref_get(&sb, bid) > 0) {
+            ref_add(&sb, bid, -1); /* on failure fsck recounts it */
+            return;
+        }
+        ddt_forget(&sb, bid);
+    }
+    free_block(bid);
+}
+
+/* take n consecutive free blocks from one group; 0 if there is no such run */
+uint16_t alloc_extent(int n) {
+    uint32_t bitmap[BLOCKSIZEWORD];
+    group_desc gd;
+    int first = -1, run = 0;
+
+    for (int g = 0; g < NGROUPS && first < 0; g++) {
+        pthread_mutex_lock(&group_lock[g].m);
+        if (read_group(g, &gd, bitmap) == 0 && gd.free_blocks >= n) {
+            run = 0;
+            for (int b = 0; b < gd.nblocks; b++) {
+                run = test_bit(bitmap, b) ? 0 : run + 1;
+                if (run == n) {
+                    first = b - n + 1;
+                    break;
+                }
+            }
+            if (first >= 0) {
+                for (int b = first; b < first + n; b++)
+                    set_bit(bitmap, b);
+                gd.free_blocks -= n;
+                write_group(g, &gd, bitmap);
+                first += gd.first_bid;
+            }
+        }
+        pthread_mutex_unlock(&group_lock[g].m);
+    }
+    return first < 0 ? 0 : first;
+}
+
+/* free a file descriptor together with its data blocks */
+void release_file(int bid) {
+    file_desc f;
+    int first = bid, last = bid;
+
+    if (read_meta(&f, bid) == -1) {
+        free_block(bid);
+        return;
+    }
+    for (int i = 0; i < 382; i++) {
+        if (f.bid[i] != 0) {
+            free_data_block(f.bid[i]);
+            if (f.bid[i] < first)
+                first = f.bid[i];
+            if (f.bid[i] > last)
+                last = f.bid[i];
+        }
+    }
+    free_block(bid);
+    disk_trim(first, last);
+}
+
+/* put bid into the first free slot of the block list; returns the slot */
+int add_block(file_desc *file, int bid) {
+    for (int i = 0; i < 382; i++) {
+        if (file->bid[i] == 0) {
+            file->bid[i] = bid;
+            if (debug)
+                printf ("wrote %d to file[%d]\n", bid, i);
+            return i;
+        }
+    }
+
+    fprintf(stderr, "ERROR: %s TOO LARGE\n", file->fname);
+    return -1;
+}
+
+/* append n data blocks to a file, placed after goal; all or nothing */
+int grow_file(file_desc *file, int n, int goal) {
+    uint16_t bid;
+    int i, k, slot[382]; /* where each new block went; fsck can leave holes */
+
+    for (k = 0; k < n; k++) {
+        bid = alloc_block(goal);
+        if (bid == 0) {
+            fprintf(stderr, "ERROR: FILE SYSTEM IS FULL\n");
+            break;
+        }
+        i = add_block(file, bid);
+        if (i == -1) {
+            free_block(bid);
+            break;
+        }
+        slot[k] = i;
+        goal = bid + 1;
+    }
+    if (k == n)
+        return 0;
+
+    /* undo exactly the blocks added so far */
+    while (k-- > 0) {
+        free_block(file->bid[slot[k]]);
+        file->bid[slot[k]] = 0;
+    }
+    return -1;
+}
+
+/* release the data blocks of a file beyond its first n */
+void shrink_file(file_desc *file, int n) {
+    int k = 0;
+    int first = BLOCKNUM, last = 0;
+
+    for (int i = 0; i < 382; i++) {
+        if (file->bid[i] != 0 && k++ >= n) {
+            free_data_block(file->bid[i]);
+            if (file->bid[i] < first)
+                first = file->bid[i];
+            if (file->bid[i] > last)
+                last = file->bid[i];
+            file->bid[i] = 0;
+        }
+    }
+    if (first <= last)
+        disk_trim(first, last);
+}
+
+int file_blocks(file_desc *file) {
+    int n = 0;
+
+    for (int i = 0; i < 382; i++) {
+        if (file->bid[i] != 0)
+            n++;
+    }
+    return n;
+}
+
+/* write block i of a file's block list. With dedup on, identical content
+ * already on disk is shared instead, and a shared block is copied before
+ * it is changed. The caller writes the file descriptor back afterwards,
+ * also when this fails (-1) because no block was left for the copy.
+ */
+int write_file_block(file_desc *file, int i, void *data) {
+    superblock sb;
+    uint64_t hash = 0;
+    uint16_t copy;
+    int old = file->bid[i], same = 0, slot = 0;
+    struct ddt_entry e;
+
+    if (read_meta(&sb, 0) == -1)
+        sb.dedup = sb.ref_bid = 0;
+
+    if (sb.dedup) {
+        hash = xxh64(data, BLOCKSIZE, 0);
+        same = ddt_find(&sb, hash, data, &slot);
+        if (same == old)
+            return 0; /* already holds this content */
+        if (same != 0 && ref_get(&sb, same) < 0xFFFF && ref_add(&sb, same, 1) == 0) {
+            file->bid[i] = same;
+            free_data_block(old);
+            return 0;
+        }
+    }
+
+    /* keep a block of our own: copy it if shared, else drop its old print */
+    if (sb.ref_bid != 0) {
+        if (ref_get(&sb, old) > 0) {
+            copy = alloc_block(old);
+            if (copy == 0) {
+                fprintf(stderr, "ERROR: FILE SYSTEM IS FULL\n");
+                return -1;
+            }
+            if (ref_add(&sb, old, -1) == -1) {
+                free_block(copy);
+                return -1;
+            }
+            file->bid[i] = old = copy;
+        } else {
+            ddt_forget(&sb, old);
+            if (sb.dedup) /* forgetting may have moved entries */
+                same = ddt_find(&sb, hash, data, &slot);
+        }
+    }
+    write_block(data, old);
+
+    if (sb.dedup && same == 0 && sb.ddt_used < NDDT * 3 / 4) {
+        e.hash = hash;
+        e.bid = old;
+        ddt_set(&sb, slot, &e);
+        sb.ddt_used++;
+        write_meta(&sb, 0);
+    }
+    return 0;
+}
+
+
+void ls(dir_desc dir) {
+    int i = 0;
+    file_desc f;
+    dir_desc d;
+
+    printf("--------\n");
+    for (i = 0; i < 190; i++) {
+        if (dir.e[i].bid) {
+            if (dir.e[i].type) {
+                if (read_meta(&f, dir.e[i].bid) == 0)
+                    printf("%s      %d Byte\n", f.fname, f.fsize);
+            } else {
+                if (read_meta(&d, dir.e[i].bid) == 0)
+                    printf("%s      %d\n", d.dname, d.dnum);
+            }
+        }
+    }
+    printf("\n");
+}
+
+void dfs(uint16_t bid) {
+    int i;
+    dir_desc d;
+
+    if (read_meta(&d, bid) == -1)
+        return;
+    printf("%s: \n", d.dname);
+    ls(d);
+    for (i = 0; i <  190; i++) {
+        if ((d.e[i].bid) && (!d.e[i].type)) {
+            dfs(d.e[i].bid);
+        }
+    }
+}
+
+/*--------------------------------------------------------------------------------*/
+
+/* Open the backend called name (mem if empty) on path. The open goes into
+ * a copy of its devices[] entry, so that the current disk, possibly the
+ * same backend, stays usable if it fails. With sb set, the device must
+ * already hold a file system and its superblock is returned there. The caller
+ * switches with switch_disk().
+ */
+int open_disk(struct blkdev *opened, char *name, char *path, superblock *sb) {
+    struct blkdev *newdev = devices;
+    uint32_t csum;
+
+    if (name[0] != '\0') {
+        while (newdev->name != NULL && strcmp(newdev->name, name))
+            newdev++;
+        if (newdev->name == NULL) {
+            printf("Unknown device '%s'.\n", name);
+            return -1;
+        }
+    }
+    *opened = *newdev;
+    if (opened->open(opened, path, sb == NULL) == -1) {
+        printf("disk allocation failed\n");
+        return -1;
+    }
+    if (sb == NULL)
+        return 0;
+
+    /* the image may be the current disk, with its superblock still cached */
+    if (dev != NULL && dev->cached)
+        bsync();
+    opened->read(opened, sb, 0, 1);
+    memcpy(&csum, (uint8_t *)sb + BLOCKSIZE - 4, 4);
+    if (csum != meta_csum(sb, 0) || sb->fs_size != DISKSIZE ||
+        sb->ngroups != NGROUPS || sb->blocks_per_group != BLOCKSPERGROUP) {
+        printf("%s: no file system found\n", path);
+        opened->close(opened);
+        return -1;
+    }
+    return 0;
+}
+
+/* close the current disk and make opened the new one */
+void switch_disk(struct blkdev *opened) {
+    struct blkdev *newdev = devices;
+    static int locks_ready = 0;
+
+    while (strcmp(newdev->name, opened->name))
+        newdev++;
+    close_disk();
+    *newdev = *opened;
+    dev = newdev;
+    if (dev->cached)
+        binit();
+    if (!locks_ready) {
+        for (int g = 0; g < NGROUPS; g++)
+            pthread_mutex_init(&group_lock[g].m, NULL);
+        locks_ready = 1;
+    }
+}
+
+int do_root(char *name, char *size) {
+    superblock sb;
+    uint32_t bitmap[BITMAPSIZEWORD];
+    group_desc gd;
+    dir_desc root;
+    struct blkdev opened;
+    int i;
+
+    if (txn.active)
+        return -1;
+    if (open_disk(&opened, name, size, NULL) == -1)
+        return -1;
+    switch_disk(&opened);
+    cwd = 6;
+    dev->trim(dev, 0, BLOCKNUM); /* drop what an old image held */
+
+    /* initialize superblock */
+    memset(bitmap, 0, sizeof(uint32_t) * BITMAPSIZEWORD);
+    set_bit(bitmap, 0); /* block 0 for superblock */
+
+    memset(&sb, 0, sizeof(superblock));
+    sb.fs_size = DISKSIZE;
+    sb.ngroups = NGROUPS;
+    sb.blocks_per_group = BLOCKSPERGROUP;
+    sb.gdt_bid = GDTBID;
+
+    /* block 1-5 for bitmap */
+    for (i = 1; i <= 5; i++)
+        set_bit(bitmap, i);
+
+    /* block 6 for root directory */
+    memset(&root, 0, sizeof(dir_desc));
+    strcpy(root.dname, "root");
+    set_bit(bitmap, 6);
+    root.parbid = 6;
+    sb.root_bid = 6;
+
+    /* block 7-11 for group descriptors */
+    for (i = GDTBID; i < RESERVEDBLOCKS; i++)
+        set_bit(bitmap, i);
+
+    /* write descriptors to blocks*/
+    write_meta(&sb, 0);
+    //print_block(1);
+    write_meta(&root, 6);
+
+    for (i = 0; i < NGROUPS; i++) {
+        memset(&gd, 0, sizeof(group_desc));
+        gd.bitmap_bid = i + 1;
+        gd.first_bid = i * BLOCKSPERGROUP;
+        gd.nblocks = BLOCKSPERGROUP;
+        gd.free_blocks = BLOCKSPERGROUP - (i == 0 ? RESERVEDBLOCKS : 0);
+        write_group(i, &gd, &bitmap[i * BLOCKSIZEWORD]);
+    }
+
+    printf("\n%s\\>", root.dname);
+
+    if (debug) printf("%s\n", __func__);
+    return 0;
+}
+
+int do_mount(char *name, char *size) {
+    superblock sb;
+    dir_desc root;
+    struct blkdev opened;
+
+    if (txn.active)
+        return -1;
+    if (open_disk(&opened, name, size, &sb) == -1)
+        return -1;
+    switch_disk(&opened);
+    cwd = sb.root_bid;
+    if (read_meta(&root, cwd) == -1)
+        return -1;
+
+    printf("\n%s\\>", root.dname);
+
+    if (debug) printf("%s\n", __func__);
+    return 0;
+}
+
+int do_print(char *name, char *size) {
+    dir_desc cwdd;
+
+    if (read_meta(&cwdd, cwd) == -1)
+        return -1;
+    dfs(cwd);
+
+    printf("\n%s\\>", cwdd.dname);
+    if (debug) printf("%s\n", __func__);
+    return 0;
+}
+
+int do_chdir(char *name, char *size) {
+
+    uint32_t bitmap[BITMAPSIZEWORD];
+    dir_desc cwdb, todb;
+    if (read_meta(&cwdb, cwd) == -1)
+        return -1;
+    if (read_bitmaps(bitmap) == -1)
+        return -1;
+    if (!strcmp(name, "..")) {
+        if (read_meta(&todb, cwdb.parbid) == -1)
+            return -1;
+        cwd = cwdb.parbid;
+        cwdb = todb;
+    } else {
+        int find_dir = 0;
+        for (int i = 0; i < 190; i++) {
+            if (cwdb.e[i].bid > 0) {
+                int t_a = cwdb.e[i].bid / 32;
+                int t_b = cwdb.e[i].bid % 32;
+                if ((bitmap[t_a] & (1 << t_b))) {
+                    //            printf("block %d is under this directory \n", cwdb.e[i].bid);
+                    if (cwdb.e[i].type == 0) {
+                        if (read_meta(&todb, cwdb.e[i].bid) == -1)
+                            continue;
+                        //              printf("it is a directory (%s)\n", todb.dname);
+                        if (!strcmp(todb.dname, name)) {
+                            find_dir = 1;
+                            cwd = cwdb.e[i].bid;
+                            cwdb = todb;
+                        }
+                    }
+                }
+            }
+        }
+        if (find_dir == 0) {
+            printf("Directory '%s' not found.\n", name);
+        }
+    }
+    printf("\n%s\\>", cwdb.dname);
+
+    //    printf("CD %d = (%d, %d)\n", to_dir, to_dir_block, to_dir_bit);
+
+    if (debug) printf("%s\n", __func__);
+    return 0;
+
+}
+
+int do_mkdir(char *name, char *size) {
+    int empty_block = 0;
+    dir_desc current_dir;
+
+    if (read_meta(&current_dir, cwd) == -1) //read current_dir
+        return -1;
+
+    //find an open block in the parent's group
+    empty_block = alloc_dir_block(cwd);
+    if (empty_block == 0) {
+        printf("File system is full.\n");
+        return -1;
+    }
+
+    dir_desc new_dir_desc; //new dir_desc
+    memset(&new_dir_desc, 0, sizeof(dir_desc));
+    strcpy(new_dir_desc.dname, name); //set dir_desc name
+    new_dir_desc.dnum = 0; //set number of directories/files
+    new_dir_desc.parbid = cwd; //set parent bid
+
+    write_meta(&new_dir_desc, empty_block); //write new dir_desc to empty block
+
+    update_parent(&current_dir, 0, empty_block); //update parent
+    current_dir.dnum++;
+    //printf("%d, %d", current_dir.e[0].bid, current_dir.e[0].type); //check
+    write_meta(&current_dir, cwd); //write back to block
+
+    ls(current_dir);
+
+    printf("\n%s\\>", current_dir.dname);
+
+    if (debug) printf("%s\n", __func__);
+    return 0;
+}
+
+int do_rmdir(char *name, char *size) {
+
+
+    uint32_t bitmap[BITMAPSIZEWORD];
+    dir_desc cwdb, rmdb;
+    if (read_meta(&cwdb, cwd) == -1)
+        return -1;
+    if (read_bitmaps(bitmap) == -1)
+        return -1;
+
+    int tcwd = cwd;
+    int find_dir = 0;
+    for (int i = 0; i < 190; i++) {
+        if (cwdb.e[i].bid > 0) {
+            int t_a = cwdb.e[i].bid / 32;
+            int t_b = cwdb.e[i].bid % 32;
+            if ((bitmap[t_a] & (1 << t_b))) {
+                //            printf("block %d is under this directory \n", cwdb.e[i].bid);
+                if (cwdb.e[i].type == 0) {
+                    if (read_meta(&rmdb, cwdb.e[i].bid) == -1)
+                        continue;
+                }
+                if (((!strcmp(rmdb.dname, name)) && (cwdb.e[i].type == 0)) || (!strcmp(name, "-all"))) {
+                    if (cwdb.e[i].type == 0) {
+                        find_dir = 1;
+                        cwd = cwdb.e[i].bid;
+                        char *tname = "-all";
+                        do_rmdir(tname, NULL);
+                        cwd = tcwd;
+                        free_block(cwdb.e[i].bid);
+                    } else {
+                        release_file(cwdb.e[i].bid);
+                    }
+                    cwdb.e[i].bid = 0;
+                }
+            }
+        }
+    }
+    if ((find_dir == 0) && (strcmp(name, "-all"))) {
+        printf("Directory '%s' not found.\n", name);
+    }
+
+    write_meta(&cwdb, cwd);
+    ls(cwdb);
+    //    for (int i=0; i<BITMAPSIZEWORD; i++) {
+    //        printf("%d", bitmap[0]);
+    //    }
+
+    printf("\n%s\\>", cwdb.dname);
+    if (debug) printf("%s\n", __func__);
+    return 0;
+}
+
+int do_mvdir(char *name, char *size) {
+
+    uint32_t bitmap[BITMAPSIZEWORD];
+    dir_desc cwdb, mvdb;
+    if (read_meta(&cwdb, cwd) == -1)
+        return -1;
+    if (read_bitmaps(bitmap) == -1)
+        return -1;
 
     int find_dir = 0;
     for (int i = 0; i < 190; i++) {
@@ -458,12 +1845,13 @@ int do_mvdir(char *name, char *size) {
             if ((bitmap[t_a] & (1 << t_b))) {
                 //            printf("block %d is under this directory \n", cwdb.e[i].bid);
                 if (cwdb.e[i].type == 0) {
-                    read_block( &mvdb, cwdb.e[i].bid);
+                    if (read_meta(&mvdb, cwdb.e[i].bid) == -1)
+                        continue;
                     if (!strcmp(mvdb.dname, name)) {
                         find_dir = 1;
 
                         strcpy(mvdb.dname, size);
-                        write_block(&mvdb, cwdb.e[i].bid);
+                        write_meta(&mvdb, cwdb.e[i].bid);
                     }
                 }
             }
@@ -480,264 +1868,828 @@ int do_mvdir(char *name, char *size) {
     return 0;
 }
 
-// TODO: check file size, if file is bigger than block store it on multiple blocks
-int do_mkfil(char *name, char *size) {
+// TODO: check file size, if file is bigger than block store it on multiple blocks
+int do_mkfil(char *name, char *size) {
+
+    dir_desc current_dir;
+    int file_size = atoi(size);
+    int number_of_blocks;
+    int file_desc_block;
+    file_desc new_file_desc;
+
+    if (size[0] == '\0')
+        file_size = 0;
+    number_of_blocks = 1 + ((file_size - 1) / BLOCKSIZE);
+
+    memset(&new_file_desc, 0, sizeof(file_desc));
+    strcpy(new_file_desc.fname, name);
+    new_file_desc.fsize = file_size;
+
+    if (read_meta(&current_dir, cwd) == -1) //read current_dir
+        return -1;
+    //store file descriptor in the parent's group, data blocks right after it
+    file_desc_block = alloc_block(cwd);
+    if (file_desc_block == 0) {
+        printf("File system is full.\n");
+        return -1;
+    }
+    if (grow_file(&new_file_desc, number_of_blocks, file_desc_block) == -1) {
+        free_block(file_desc_block);
+        return -1;
+    }
+    write_meta(&new_file_desc, file_desc_block);
+
+    update_parent(&current_dir, 1, file_desc_block);    //update parent
+    current_dir.dnum++;
+    //    printf("%d, %d", current_dir.e[0].bid, current_dir.e[0].type); //check
+    write_meta(&current_dir, cwd);
+
+    ls(current_dir);
+    printf("\n%s\\>", current_dir.dname);
+
+    if (debug) printf("%s\n", __func__);
+    return 0;
+}
+
+int do_rmfil(char *name, char *size) {
+
+    uint32_t bitmap[BITMAPSIZEWORD];
+    dir_desc cwdb;
+    file_desc rmfb;
+    if (read_meta(&cwdb, cwd) == -1)
+        return -1;
+    if (read_bitmaps(bitmap) == -1)
+        return -1;
+
+    int find_fil = 0;
+    for (int i = 0; i < 190; i++) {
+        if (cwdb.e[i].bid > 0) {
+            int t_a = cwdb.e[i].bid / 32;
+            int t_b = cwdb.e[i].bid % 32;
+            if ((bitmap[t_a] & (1 << t_b))) {
+                //            printf("block %d is under this directory \n", cwdb.e[i].bid);
+                if (cwdb.e[i].type == 1) {
+                    if (read_meta(&rmfb, cwdb.e[i].bid) == -1)
+                        continue;
+                }
+                if ((cwdb.e[i].type == 1) && (!strcmp(rmfb.fname, name))) {
+                    find_fil = 1;
+                    release_file(cwdb.e[i].bid);
+                    cwdb.e[i].bid = 0;
+                }
+            }
+        }
+    }
+    if (find_fil == 0) {
+        printf("File '%s' not found.\n", name);
+    }
+
+    write_meta(&cwdb, cwd);
+
+    ls(cwdb);
+    printf("\n%s\\>", cwdb.dname);
+
+    if (debug) printf("%s\n", __func__);
+    return 0;
+}
+
+int do_mvfil(char *name, char *size) {
+
+    uint32_t bitmap[BITMAPSIZEWORD];
+    dir_desc cwdb;
+    file_desc mvfb;
+    if (read_meta(&cwdb, cwd) == -1)
+        return -1;
+    if (read_bitmaps(bitmap) == -1)
+        return -1;
+
+    int find_fil = 0;
+    for (int i = 0; i < 190; i++) {
+        if (cwdb.e[i].bid > 0) {
+            int t_a = cwdb.e[i].bid / 32;
+            int t_b = cwdb.e[i].bid % 32;
+            if ((bitmap[t_a] & (1 << t_b))) {
+                //            printf("block %d is under this directory \n", cwdb.e[i].bid);
+                if (cwdb.e[i].type == 1) {
+                    if (read_meta(&mvfb, cwdb.e[i].bid) == -1)
+                        continue;
+                    if (!strcmp(mvfb.fname, name)) {
+                        find_fil = 1;
+
+                        strcpy(mvfb.fname, size);
+                        write_meta(&mvfb, cwdb.e[i].bid);
+                    }
+                }
+            }
+        }
+    }
+    if (find_fil == 0) {
+        printf("File '%s' not found.\n", name);
+    }
+
+    ls(cwdb);
+    printf("\n%s\\>", cwdb.dname);
+
+    if (debug) printf("%s\n", __func__);
+    return 0;
+}
+
+int do_szfil(char *name, char *size) { //christina
+
+    /* find file
+     calculate blocks needed/not needed
+     change block bitmap
+     update file descriptor
+     SZFIL ONLY WORKS ON FILES IN CURRENT DIRECTORY
+     */
+
+    dir_desc current_dir;
+    file_desc temp_block_id;
+    int file_bid;
+
+
+    //parse size into int
+    int size_of_file = atoi(size);
+    int found = 0;
+
+
+
+    //read files from directory
+    if (read_meta(&current_dir, cwd) == -1)
+        return -1;
+    /*
+     for(int i=0; i < 190; i++){
+     if(current_dir.e[i].bid != 0)
+     printf("%d ", current_dir.e[i].bid);
+     }
+     */
+    for (int i = 0; i < 190; i++) {
+        if (current_dir.e[i].bid && current_dir.e[i].type == 1) {
+            if (read_meta(&temp_block_id, current_dir.e[i].bid) == -1)
+                continue;
+            if (strcmp(temp_block_id.fname, name) == 0) {
+                file_bid = current_dir.e[i].bid;
+                found = 1;
+                break;
+            }
+        }
+    }
+    if (found == 0) {
+        printf("%s was not found\n", name);
+        return -1;
+    }
+
+    //calculate number of blocks needed
+    int num_of_blocks = 1 + ((size_of_file - 1) / BLOCKSIZE);
+    int old_blocks = file_blocks(&temp_block_id);
+    int last = file_bid;
+
+    //if the file is larger than original, add blocks after its last one
+    if (temp_block_id.fsize < size_of_file) {
+        for (int i = 0; i < 382; i++) {
+            if (temp_block_id.bid[i] != 0)
+                last = temp_block_id.bid[i];
+        }
+        if (num_of_blocks > old_blocks &&
+            grow_file(&temp_block_id, num_of_blocks - old_blocks, last + 1) == -1)
+            return -1;
+    }
+
+    //otherwise remove blocks
+    else if (temp_block_id.fsize > size_of_file) {
+        if (debug) printf(" remove: %d original: %d\n", old_blocks - num_of_blocks, old_blocks);
+        shrink_file(&temp_block_id, num_of_blocks);
+    }
+
+    else {
+        printf("Your file size is the same as the original!\n");
+        return -1;
+    }
+
+    temp_block_id.fsize = size_of_file;
+    write_meta(&temp_block_id, file_bid);
+
+    ls(current_dir);
+    printf("\n%s\\>", current_dir.dname);
+
+    if (debug) printf("%s\n", __func__);
+    return 0;
+}
+
+/* file descriptor block of `name` in dir, read into f; 0 if not found */
+int find_file(dir_desc *dir, char *name, file_desc *f) {
+    for (int i = 0; i < 190; i++) {
+        if (dir->e[i].bid && dir->e[i].type == 1) {
+            if (read_meta(f, dir->e[i].bid) == -1)
+                continue;
+            if (strcmp(f->fname, name) == 0)
+                return dir->e[i].bid;
+        }
+    }
+    printf("File '%s' not found.\n", name);
+    return 0;
+}
+
+int do_rdfil(char *name, char *size) {
+    dir_desc current_dir;
+    file_desc f;
+    struct readahead ra = { 0, 0, 0 };
+    uint8_t data[BLOCKSIZE];
+    uint32_t crc = 0;
+    int left, n;
+
+    if (read_meta(&current_dir, cwd) == -1)
+        return -1;
+    if (find_file(&current_dir, name, &f) == 0)
+        return -1;
+
+    left = f.fsize;
+    for (int i = 0; i < 382 && left > 0; i++) {
+        if (f.bid[i] == 0)
+            continue;
+        read_file_block(&f, i, data, &ra);
+        n = left < BLOCKSIZE ? left : BLOCKSIZE;
+        crc = crc32c(crc, data, n);
+        left -= n;
+    }
+    printf("%s      %d Byte, crc32c %08x\n", f.fname, f.fsize, crc);
+    if (debug) printf("cache: %ld hits, %ld misses, %ld readahead, %ld written back\n",
+                      bstats.hits, bstats.misses, bstats.readahead, bstats.writeback);
+
+    printf("\n%s\\>", current_dir.dname);
+    if (debug) printf("%s\n", __func__);
+    return 0;
+}
+
+int do_wrfil(char *name, char *size) {
+    dir_desc current_dir;
+    file_desc f;
+    uint8_t data[BLOCKSIZE];
+    int len = strlen(size), fbid, off = 0, ret = 0;
+
+    if (len == 0)
+        return -1;
+    if (read_meta(&current_dir, cwd) == -1)
+        return -1;
+    fbid = find_file(&current_dir, name, &f);
+    if (fbid == 0)
+        return -1;
+
+    for (int i = 0; i < 382; i++) {
+        if (f.bid[i] == 0)
+            continue;
+        for (int b = 0; b < BLOCKSIZE; b++, off++)
+            data[b] = off < f.fsize ? size[off % len] : 0;
+        if (write_file_block(&f, i, data) == -1) {
+            ret = -1;
+            break;
+        }
+    }
+    write_meta(&f, fbid); /* the blocks written so far */
+    if (ret == -1)
+        return -1;
+
+    ls(current_dir);
+    printf("\n%s\\>", current_dir.dname);
+    if (debug) printf("%s\n", __func__);
+    return 0;
+}
+
+int do_dedup(char *name, char *size) {
+    superblock sb;
+    dir_desc cwdd, zero;
+
+    if (dev == NULL || read_meta(&sb, 0) == -1)
+        return -1;
+    if (!strcmp(name, "on")) {
+        if (sb.ddt_bid == 0) { /* first time: create the tables */
+            sb.ddt_bid = alloc_extent(NDDTBLOCKS);
+            sb.ref_bid = alloc_extent(NREFBLOCKS);
+            if (sb.ddt_bid == 0 || sb.ref_bid == 0) {
+                for (int i = 0; sb.ddt_bid && i < NDDTBLOCKS; i++)
+                    free_block(sb.ddt_bid + i);
+                for (int i = 0; sb.ref_bid && i < NREFBLOCKS; i++)
+                    free_block(sb.ref_bid + i);
+                printf("File system is full.\n");
+                return -1;
+            }
+            for (int i = 0; i < NDDTBLOCKS; i++) {
+                memset(&zero, 0, sizeof(zero));
+                write_meta(&zero, sb.ddt_bid + i);
+            }
+            for (int i = 0; i < NREFBLOCKS; i++) {
+                memset(&zero, 0, sizeof(zero));
+                write_meta(&zero, sb.ref_bid + i);
+            }
+            sb.ddt_used = 0;
+        }
+        sb.dedup = 1;
+    } else if (!strcmp(name, "off")) {
+        sb.dedup = 0; /* shared blocks keep their references */
+    } else {
+        return -1;
+    }
+    write_meta(&sb, 0);
+
+    if (read_meta(&cwdd, cwd) == 0)
+        printf("\n%s\\>", cwdd.dname);
+    if (debug) printf("%s\n", __func__);
+    return 0;
+}
+
+int do_dedup_stats(char *name, char *size) {
+    superblock sb;
+    ref_block r;
+    dir_desc cwdd;
+    int shared = 0, saved = 0, used = 0;
+
+    if (dev == NULL || read_meta(&sb, 0) == -1)
+        return -1;
+    for (int i = 0; sb.ref_bid && i < NREFBLOCKS; i++) {
+        if (read_meta(&r, sb.ref_bid + i) == -1)
+            return -1;
+        for (int k = 0; k < 510; k++) {
+            shared += r.refs[k] > 0;
+            saved += r.refs[k];
+        }
+    }
+    for (int g = 0; g < NGROUPS; g++)
+        used += BLOCKSPERGROUP - group_free_blocks(g);
+
+    printf("dedup: %s, %d fingerprints, %d shared blocks\n",
+           sb.dedup ? "on" : "off", sb.ddt_used, shared);
+    printf("dedup: %d blocks saved (%d KB), %d blocks in use hold %d, %.2fx\n",
+           saved, saved * BLOCKSIZE / 1024, used, used + saved,
+           (double)(used + saved) / used);
+
+    if (read_meta(&cwdd, cwd) == 0)
+        printf("\n%s\\>", cwdd.dname);
+    if (debug) printf("%s\n", __func__);
+    return 0;
+}
+
+int do_sync(char *name, char *size) {
+    dir_desc cwdd;
+
+    if (dev == NULL)
+        return -1;
+    if (dev->cached)
+        bsync();
+    if (read_meta(&cwdd, cwd) == 0)
+        printf("\n%s\\>", cwdd.dname);
+    if (debug) printf("%s\n", __func__);
+    return 0;
+}
+
+int do_begin(char *name, char *size) {
+    static int slots_ready = 0;
+    dir_desc cwdd;
 
-    uint32_t bitmap[BITMAPSIZEWORD];
-    uint16_t empty_block = 0;
-    dir_desc current_dir;
-    int file_size = atoi(size);
-    int number_of_blocks;
-    int file_desc_block;
-    file_desc new_file_desc;
+    if (dev == NULL || txn.active)
+        return -1;
+    if (!slots_ready) {
+        for (int i = 0; i < BLOCKNUM; i++)
+            txn.slot[i] = -1;
+        slots_ready = 1;
+    }
+    txn.active = 1;
+    txn.n = 0;
+    txn.cwd = cwd;
+    txn.trim_first = BLOCKNUM;
+    txn.trim_last = 0;
+
+    if (read_meta(&cwdd, cwd) == 0)
+        printf("\n%s\\>", cwdd.dname);
+    if (debug) printf("%s\n", __func__);
+    return 0;
+}
 
-    int k = 1;
-    int j;
-    int i;
+/* leave the transaction, forgetting the dirty set */
+void txn_end(void) {
+    for (int i = 0; i < txn.n; i++)
+        txn.slot[txn.bid[i]] = -1;
+    txn.n = 0;
+    txn.active = 0;
+    txn.failed = 0;
+}
 
-    if (size[0] == '\0')
-        file_size = 0;
-    number_of_blocks = 1 + ((file_size - 1) / BLOCKSIZE);
+/* run after every command: a failed transaction is aborted right away and
+ * the command that failed it reported as failed */
+int txn_check(void) {
+    dir_desc cwdd;
 
-    memset(&new_file_desc, 0, sizeof(file_desc));
-    strcpy(new_file_desc.fname, name);
-    new_file_desc.fsize = file_size;
+    if (!txn.failed)
+        return 0;
+    printf("abort: out of memory, %d blocks discarded\n", txn.n);
+    txn_end();
+    cwd = txn.cwd;
+    if (read_meta(&cwdd, cwd) == 0)
+        printf("\n%s\\>", cwdd.dname);
+    return -1;
+}
 
-    read_block(&current_dir, cwd); //read current_dir
-    //store file descriptor
-    for (i = 1; i <= 5; i++) {
-        read_block(bitmap, i);
-        file_desc_block = empty_bid(bitmap);
-        if (file_desc_block != 0) {
-            write_block(&new_file_desc, file_desc_block);
-            set_bit(bitmap, file_desc_block);
-            write_block(bitmap, i);
-            break;
-        }
-    }
+int txn_cmp(const void *a, const void *b) {
+    return *(const int *)a - *(const int *)b;
+}
 
+int do_commit(char *name, char *size) {
+    dir_desc cwdd;
+    int n = txn.n;
 
-    for (j = i; j <= 5; j++) {
-        read_block(bitmap, j);
-        while (k <= number_of_blocks && k < BITMAPSIZEWORD) {
-            empty_block = empty_bid(bitmap);
-            if (empty_block != 0) {
-                set_bit(bitmap, empty_block);
-                if (debug) printf("set bit %d to %d\n", empty_block, 1);
-                if (add_block(&new_file_desc, empty_block) == -1)
-                    break;
-                k++;
-            }
-        }
+    if (!txn.active || txn.failed)
+        return -1;
 
-        if (k - 1 == number_of_blocks) {
-            write_block(bitmap, j);
-            break;
-        }
-    }
+    /* in block order, so the cache can merge neighbours when writing back */
+    qsort(txn.bid, n, sizeof(int), txn_cmp);
+    txn.active = 0;
+    for (int i = 0; i < n; i++)
+        write_block(&txn.data[(size_t)txn.slot[txn.bid[i]] * BLOCKSIZE], txn.bid[i]);
+    txn_end();
+    if (txn.trim_first <= txn.trim_last)
+        disk_trim(txn.trim_first, txn.trim_last);
+    if (dev->cached)
+        bsync();
+
+    printf("commit: %d blocks written\n", n);
+    if (read_meta(&cwdd, cwd) == 0)
+        printf("\n%s\\>", cwdd.dname);
+    if (debug) printf("%s\n", __func__);
+    return 0;
+}
 
-    update_parent(&current_dir, 1, file_desc_block);    //update parent
-    current_dir.dnum++;
-    //    printf("%d, %d", current_dir.e[0].bid, current_dir.e[0].type); //check
-    write_block(&current_dir, cwd);
+int do_abort(char *name, char *size) {
+    dir_desc cwdd;
+    int n = txn.n;
 
-    ls(current_dir);
-    printf("\n%s\\>", current_dir.dname);
+    if (!txn.active)
+        return -1;
+    txn_end();
+    cwd = txn.cwd;
 
+    printf("abort: %d blocks discarded\n", n);
+    if (read_meta(&cwdd, cwd) == 0)
+        printf("\n%s\\>", cwdd.dname);
     if (debug) printf("%s\n", __func__);
     return 0;
 }
 
-int do_rmfil(char *name, char *size) {
-
-    uint32_t bitmap[BITMAPSIZEWORD];
-    dir_desc cwdb;
-    file_desc rmfb;
-    read_block( &cwdb, cwd);
-    for (int i = 0; i < 5; i++) {
-        read_block(&bitmap[i * BLOCKSIZEWORD], i + 1);
-    }
-
-    int find_fil = 0;
-    for (int i = 0; i < 190; i++) {
-        if (cwdb.e[i].bid > 0) {
-            int t_a = cwdb.e[i].bid / 32;
-            int t_b = cwdb.e[i].bid % 32;
-            if ((bitmap[t_a] & (1 << t_b))) {
-                //            printf("block %d is under this directory \n", cwdb.e[i].bid);
-                if (cwdb.e[i].type == 1) {
-                    read_block( &rmfb, cwdb.e[i].bid);
-                }
-                if (!strcmp(rmfb.fname, name)) {
-                    find_fil = 1;
-                    for (int i = 0; i < 5; i++) {
-                        read_block(&bitmap[i * BLOCKSIZEWORD], i + 1);
-                    }
-                    clear_bit(bitmap, cwdb.e[i].bid);
-                    for (int i = 0; i < 5; i++) {
-                        write_block(&bitmap[i * BLOCKSIZEWORD], i + 1);
-                    }
-                    cwdb.e[i].bid = 0;
-                }
-            }
-        }
-    }
-    if (find_fil == 0) {
-        printf("File '%s' not found.\n", name);
-    }
+/* fsck walks the tree from the root, one thread per subtree of the root.
+ * Every reachable block is marked in `reach`; a block reached twice is
+ * cross-linked. Entries that are out of range, cross-linked or fail their
+ * checksum are dropped from their directory, and the bitmap is then
+ * rebuilt from `reach`. With dedup, a data block may be reached from
+ * several files; `nref` counts them, the reference table is rewritten from
+ * it and fingerprints of blocks no file reaches are dropped.
+ */
+uint32_t reach[BITMAPSIZEWORD];
+uint32_t nref[BLOCKNUM]; /* file block lists naming each data block */
 
-    write_block( &cwdb, cwd);
+struct fsck_state {
+    superblock sb;
+    dir_desc root;
+    int root_bid;
+    int next; /* next root entry to hand out */
+    int drop[190]; /* root entries to remove */
+    int ndirs, nfiles, ndata, errors;
+};
 
-    ls(cwdb);
-    printf("\n%s\\>", cwdb.dname);
+/* mark a block as reachable; -1 if it is out of range or already marked */
+int fsck_mark(int bid) {
+    uint32_t mask = 1u << (bid % 32);
 
-    if (debug) printf("%s\n", __func__);
+    if (bid < RESERVEDBLOCKS || bid >= BLOCKNUM)
+        return -1;
+    if (__atomic_fetch_or(&reach[bid / 32], mask, __ATOMIC_RELAXED) & mask)
+        return -1;
     return 0;
 }
 
-int do_mvfil(char *name, char *size) {
+void fsck_unmark(int bid) {
+    __atomic_fetch_and(&reach[bid / 32], ~(1u << (bid % 32)), __ATOMIC_RELAXED);
+}
 
-    uint32_t bitmap[BITMAPSIZEWORD];
-    dir_desc cwdb;
-    file_desc mvfb;
-    read_block( &cwdb, cwd);
-    for (int i = 0; i < 5; i++) {
-        read_block(&bitmap[i * BLOCKSIZEWORD], i + 1);
+void fsck_error(struct fsck_state *st, const char *what, int bid, int parent) {
+    printf("fsck: %s block %d in directory block %d, dropped\n", what, bid, parent);
+    __atomic_add_fetch(&st->errors, 1, __ATOMIC_RELAXED);
+}
+
+/* count a reference to data block bid; -1 if it is out of range or
+ * cross-linked. Only dedup shares data blocks between files. */
+int fsck_data(struct fsck_state *st, int bid) {
+    if (bid < RESERVEDBLOCKS || bid >= BLOCKNUM)
+        return -1;
+    if (__atomic_fetch_add(&nref[bid], 1, __ATOMIC_RELAXED) == 0) {
+        if (fsck_mark(bid) == 0) {
+            __atomic_add_fetch(&st->ndata, 1, __ATOMIC_RELAXED);
+            return 0;
+        }
+    } else if (st->sb.ref_bid != 0) {
+        return 0;
     }
+    __atomic_sub_fetch(&nref[bid], 1, __ATOMIC_RELAXED);
+    return -1;
+}
 
-    int find_fil = 0;
-    for (int i = 0; i < 190; i++) {
-        if (cwdb.e[i].bid > 0) {
-            int t_a = cwdb.e[i].bid / 32;
-            int t_b = cwdb.e[i].bid % 32;
-            if ((bitmap[t_a] & (1 << t_b))) {
-                //            printf("block %d is under this directory \n", cwdb.e[i].bid);
-                if (cwdb.e[i].type == 1) {
-                    read_block( &mvfb, cwdb.e[i].bid);
-                    if (!strcmp(mvfb.fname, name)) {
-                        find_fil = 1;
+/* check the entry `e` of directory `parent`; -1 means drop the entry */
+int fsck_entry(struct fsck_state *st, struct entry *e, int parent) {
+    union {
+        file_desc f;
+        dir_desc d;
+    } b;
+    int dirty = 0;
 
-                        strcpy(mvfb.fname, size);
-                        write_block(&mvfb, cwdb.e[i].bid);
-                    }
-                }
-            }
-        }
+    if (fsck_mark(e->bid) == -1) {
+        fsck_error(st, "cross-linked or out of range", e->bid, parent);
+        return -1;
     }
-    if (find_fil == 0) {
-        printf("File '%s' not found.\n", name);
+    if (read_meta(&b, e->bid) == -1) {
+        fsck_unmark(e->bid);
+        fsck_error(st, "corrupted", e->bid, parent);
+        return -1;
     }
 
-    ls(cwdb);
-    printf("\n%s\\>", cwdb.dname);
+    if (e->type) {
+        __atomic_add_fetch(&st->nfiles, 1, __ATOMIC_RELAXED);
+        for (int i = 0; i < 382; i++) {
+            if (b.f.bid[i] == 0 || fsck_data(st, b.f.bid[i]) == 0)
+                continue;
+            fsck_error(st, "cross-linked or out of range data", b.f.bid[i], e->bid);
+            b.f.bid[i] = 0;
+            dirty = 1;
+        }
+    } else {
+        __atomic_add_fetch(&st->ndirs, 1, __ATOMIC_RELAXED);
+        if (b.d.parbid != parent) {
+            printf("fsck: directory block %d had parent %d, set to %d\n", e->bid, b.d.parbid, parent);
+            __atomic_add_fetch(&st->errors, 1, __ATOMIC_RELAXED);
+            b.d.parbid = parent;
+            dirty = 1;
+        }
+        for (int i = 0; i < 190; i++) {
+            if (b.d.e[i].bid && fsck_entry(st, &b.d.e[i], e->bid) == -1) {
+                b.d.e[i].bid = 0;
+                dirty = 1;
+            }
+        }
+    }
 
-    if (debug) printf("%s\n", __func__);
+    if (dirty)
+        write_meta(&b, e->bid);
     return 0;
 }
 
-int do_szfil(char *name, char *size) { //christina
-
-    /* find file
-     calculate blocks needed/not needed
-     change block bitmap
-     update file descriptor
-     SZFIL ONLY WORKS ON FILES IN CURRENT DIRECTORY
-     */
+/* rewrite the reference table from nref; returns the counts that changed */
+int fsck_refs(struct fsck_state *st, superblock *sb) {
+    ref_block r;
+    int fixed = 0, changed, bid, want;
+
+    for (int i = 0; i < NREFBLOCKS; i++) {
+        changed = 0;
+        if (read_meta(&r, sb->ref_bid + i) == -1) {
+            st->errors++;
+            memset(&r, 0, sizeof(r));
+            changed = 1;
+        }
+        for (int k = 0; k < 510; k++) {
+            bid = i * 510 + k;
+            want = bid < BLOCKNUM && nref[bid] > 1 ? nref[bid] - 1 : 0;
+            if (want > 0xFFFF)
+                want = 0xFFFF;
+            if (r.refs[k] != want) {
+                r.refs[k] = want;
+                fixed++;
+                changed = 1;
+            }
+        }
+        if (changed)
+            write_meta(&r, sb->ref_bid + i);
+    }
+    return fixed;
+}
 
-    dir_desc current_dir;
-    file_desc temp_block_id;
-    int file_bid;
+/* rebuild the fingerprint table from the entries naming a data block that
+ * is still reached; returns how many were dropped */
+int fsck_prints(struct fsck_state *st, superblock *sb) {
+    static ddt_block old[NDDTBLOCKS], fresh[NDDTBLOCKS];
+    struct ddt_entry *e;
+    int dropped = 0, bad = 0, used = 0, k;
+
+    memset(fresh, 0, sizeof(fresh));
+    for (int i = 0; i < NDDTBLOCKS; i++) {
+        if (read_meta(&old[i], sb->ddt_bid + i) == -1) {
+            st->errors++;
+            memset(&old[i], 0, sizeof(ddt_block));
+            bad = 1;
+        }
+    }
+    for (int i = 0; i < NDDT; i++) {
+        e = &old[i / 63].e[i % 63];
+        if (e->bid == 0)
+            continue;
+        if (e->bid < RESERVEDBLOCKS || e->bid >= BLOCKNUM || nref[e->bid] == 0) {
+            dropped++;
+            continue;
+        }
+        for (k = e->hash % NDDT; fresh[k / 63].e[k % 63].bid != 0; k = (k + 1) % NDDT)
+            ;
+        fresh[k / 63].e[k % 63] = *e;
+        used++;
+    }
+    if (dropped > 0 || bad) {
+        for (int i = 0; i < NDDTBLOCKS; i++)
+            write_meta(&fresh[i], sb->ddt_bid + i);
+    }
+    if (sb->ddt_used != used) {
+        sb->ddt_used = used;
+        write_meta(sb, 0);
+    }
+    return dropped;
+}
 
+void *fsck_thread(void *arg) {
+    struct fsck_state *st = arg;
+    int i;
 
-    //parse size into int
-    int size_of_file = atoi(size);
-    int found = 0;
+    while ((i = __atomic_fetch_add(&st->next, 1, __ATOMIC_RELAXED)) < 190) {
+        if (st->root.e[i].bid)
+            st->drop[i] = fsck_entry(st, &st->root.e[i], st->root_bid);
+    }
+    return NULL;
+}
 
+int do_fsck(char *name, char *size) {
+    static struct fsck_state st;
+    superblock sb;
+    group_desc gd;
+    uint32_t bitmap[BLOCKSIZEWORD];
+    pthread_t tid[64];
+    int nthreads = atoi(name), started = 0;
+    int leaked = 0, missing = 0, dirty = 0, refs_fixed = 0, prints_dropped = 0;
+    dir_desc cwdd;
 
+    if (dev == NULL || txn.active) /* its threads would share the dirty set */
+        return -1;
+    if (nthreads <= 0)
+        nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+    if (nthreads > 64)
+        nthreads = 64;
 
-    //read files from directory
-    read_block(&current_dir, cwd);
-    /*
-     for(int i=0; i < 190; i++){
-     if(current_dir.e[i].bid != 0)
-     printf("%d ", current_dir.e[i].bid);
-     }
-     */
-    for (int i = 0; i < 190; i++) {
-        if (current_dir.e[i].type == 1) {
-            read_block(&temp_block_id, current_dir.e[i].bid);
-            if (strcmp(temp_block_id.fname, name) == 0) {
-                file_bid = current_dir.e[i].bid;
-                found = 1;
-                break;
-            }
-        }
+    if (read_meta(&sb, 0) == -1) {
+        printf("fsck: superblock is corrupted\n");
+        return -1;
     }
-    if (found == 0) {
-        printf("%s was not found\n", name);
+    memset(&st, 0, sizeof(st));
+    if (read_meta(&st.root, sb.root_bid) == -1) {
+        printf("fsck: root directory is corrupted\n");
         return -1;
     }
+    memset(reach, 0, sizeof(reach));
+    memset(nref, 0, sizeof(nref));
+    for (int i = 0; i < RESERVEDBLOCKS; i++)
+        set_bit(reach, i);
+    st.sb = sb;
+    st.root_bid = sb.root_bid;
+    st.ndirs = 1;
+
+    /* the dedup tables are reachable from the superblock */
+    if (sb.ddt_bid != 0) {
+        for (int i = 0; i < NDDTBLOCKS; i++)
+            fsck_mark(sb.ddt_bid + i);
+        for (int i = 0; i < NREFBLOCKS; i++)
+            fsck_mark(sb.ref_bid + i);
+    }
 
-    //calculate number of blocks needed
-    int num_of_blocks = 1 + ((size_of_file - 1) / BLOCKSIZE);
-    int k = 1;
-    uint32_t bitmap[BITMAPSIZEWORD];
-    uint16_t empty_block = 0;
+    /* the threads share st.next, so any that start finish the scan */
+    while (started < nthreads && pthread_create(&tid[started], NULL, fsck_thread, &st) == 0)
+        started++;
+    if (started == 0)
+        fsck_thread(&st);
+    for (int i = 0; i < started; i++)
+        pthread_join(tid[i], NULL);
 
-    //if the file is larger than original, add blocks
-    if (temp_block_id.fsize < size_of_file) {
-        for (int j = 1; j <= 5; j++) {
-            read_block(bitmap, j);
-            while (k <= num_of_blocks && k < BITMAPSIZEWORD) {
-                empty_block = empty_bid(bitmap);
-                if (empty_block != 0) {
-                    set_bit(bitmap, empty_block);
-                    //print_bitmap(bitmap, 20);
-                    add_block(&temp_block_id, empty_block);
-                    k++;
-                }
-            }
-            if (k - 1 == num_of_blocks) {
-                write_block(bitmap, j);
-                break;
-            }
+    for (int i = 0; i < 190; i++) {
+        if (st.drop[i]) {
+            st.root.e[i].bid = 0;
+            dirty = 1;
         }
     }
+    if (dirty)
+        write_meta(&st.root, sb.root_bid);
 
-    //otherwise remove blocks
-    else if (temp_block_id.fsize > size_of_file) {
-        //calculate blocks to remove
-        int remove_blocks = (1 + ((temp_block_id.fsize - 1) / BLOCKSIZE)) - num_of_blocks;
-        if (debug) printf("Current disk bitmap %d\n", 1 + ((cwd - 1) / BLOCKSIZE));
-        //read cwd bitmap
-        read_block(bitmap, 1 + ((cwd - 1) / BLOCKSIZE));
-        if (debug) printf(" remove: %d original: %d\n", remove_blocks, (1 + ((temp_block_id.fsize - 1) / BLOCKSIZE)));
-        if (debug) print_bitmap(bitmap, 20);
-        for (int m = 0; m < remove_blocks; m++) {
-            clear_bit(bitmap, m);
+    if (sb.ddt_bid != 0) {
+        refs_fixed = fsck_refs(&st, &sb);
+        prints_dropped = fsck_prints(&st, &sb);
+    }
+
+    /* rebuild every group from the reachable set */
+    for (int g = 0; g < NGROUPS; g++) {
+        pthread_mutex_lock(&group_lock[g].m);
+        if (read_meta(&gd, GDTBID + g) == -1) {
+            printf("fsck: group descriptor %d rebuilt\n", g);
+            st.errors++;
+            memset(&gd, 0, sizeof(group_desc));
+            gd.bitmap_bid = g + 1;
+            gd.first_bid = g * BLOCKSPERGROUP;
+            gd.nblocks = BLOCKSPERGROUP;
+        }
+        read_block(bitmap, gd.bitmap_bid);
+        gd.free_blocks = gd.nblocks;
+        for (int i = 0; i < BLOCKSIZEWORD; i++) {
+            uint32_t want = reach[g * BLOCKSIZEWORD + i];
+            leaked += __builtin_popcount(bitmap[i] & ~want);
+            missing += __builtin_popcount(want & ~bitmap[i]);
+            gd.free_blocks -= __builtin_popcount(want);
+            bitmap[i] = want;
         }
+        write_group(g, &gd, bitmap);
+        pthread_mutex_unlock(&group_lock[g].m);
+    }
+
+    printf("fsck: %d directories, %d files, %d data blocks, %d errors\n",
+           st.ndirs, st.nfiles, st.ndata, st.errors);
+    printf("fsck: bitmap rebuilt, %d leaked and %d missing blocks fixed\n", leaked, missing);
+    if (sb.ddt_bid != 0)
+        printf("fsck: %d reference counts fixed, %d stale fingerprints dropped\n",
+               refs_fixed, prints_dropped);
+
+    if (read_meta(&cwdd, cwd) == 0)
+        printf("\n%s\\>", cwdd.dname);
+    if (debug) printf("%s\n", __func__);
+    return 0;
+}
+
+struct bench_arg {
+    int group; /* group this thread allocates in */
+    int count; /* how many blocks to allocate */
+    int done; /* how many it did, fewer when the disk filled up */
+};
 
-        write_block(bitmap, 1 + ((cwd - 1) / BLOCKSIZE));
-        if (debug) print_bitmap(bitmap, 1);
+void *bench_thread(void *arg) {
+    struct bench_arg *b = arg;
+    uint16_t bids[64];
+    int goal = b->group * BLOCKSPERGROUP;
+    int n;
+
+    for (b->done = 0; b->done < b->count; b->done += n) {
+        for (n = 0; n < 64 && b->done + n < b->count; n++) {
+            bids[n] = alloc_block(goal);
+            if (bids[n] == 0)
+                break;
+        }
+        for (int i = 0; i < n; i++)
+            free_block(bids[i]);
+        if (n == 0)
+            break;
     }
+    return NULL;
+}
 
-    else {
-        printf("Your file size is the same as the original!\n");
+/* one group per thread, so only the first NGROUPS threads allocate
+ * without contending; more threads share groups */
+int do_bench(char *name, char *size) {
+    int nthreads = atoi(name);
+    int count = atoi(size);
+    int started = 0, total = 0;
+    pthread_t tid[64];
+    struct bench_arg args[64];
+    struct timespec t0, t1;
+    double secs;
+
+    if (dev == NULL || txn.active || nthreads <= 0 || nthreads > 64 || count <= 0)
         return -1;
-    }
 
-    temp_block_id.fsize = size_of_file;
-    write_block(&temp_block_id, file_bid);
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    for (int i = 0; i < nthreads; i++) {
+        args[i].group = i % NGROUPS;
+        args[i].count = count;
+        if (pthread_create(&tid[i], NULL, bench_thread, &args[i]) != 0) {
+            fprintf(stderr, "ERROR: ONLY %d BENCH THREADS STARTED\n", started);
+            break;
+        }
+        started++;
+    }
+    for (int i = 0; i < started; i++) {
+        pthread_join(tid[i], NULL);
+        total += args[i].done;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    if (started == 0)
+        return -1;
 
-    ls(current_dir);
-    printf("\n%s\\>", current_dir.dname);
+    secs = (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9;
+    printf("bench: %d threads on %d groups, %d allocations in %.3f s, %.0f allocations/s\n",
+           started, started < NGROUPS ? started : NGROUPS, total, secs, total / secs);
 
     if (debug) printf("%s\n", __func__);
     return 0;
 }
 
 int do_exit(char *name, char *size) {
-    free(disk);
+    if (txn.active) {
+        printf("abort: uncommitted transaction discarded\n");
+        txn_end();
+    }
+    close_disk();
     if (debug) printf("%s\n", __func__);
     exit(0);
     return 0;
@@ -774,3 +2726,148 @@ void parse(char *buf, int *argc, char *argv[]) {
 
 /*--------------------------------------------------------------------------------*/
 
+/* Binary command stream: BINMAGIC, then one record per command
+ *
+ *   opcode          1 Byte, the op of the command in table[]
+ *   filename        1 Byte length n, n Byte, '\0'
+ *   filesize        1 Byte length n, n Byte, '\0'
+ *
+ * The arguments are handed to the actions right where they sit in the read
+ * buffer. Opcodes are fixed per command and a new command takes the next
+ * free one, so compiled scripts keep working when table[] changes; an
+ * opcode the program does not know is rejected.
+ */
+
+int compile(FILE *in, FILE *out) {
+    char whsp[] = " \t\n\v\f\r";
+    char *line = NULL, *p, *tok[3];
+    size_t cap = 0, len[3];
+    int lineno = 0, errors = 0, n, op;
+
+    fwrite(BINMAGIC, 1, 4, out);
+    while (getline(&line, &cap, in) != -1) {
+        lineno++;
+        for (n = 0, p = line; n < 3; n++) {  // extra words are ignored
+            p += strspn(p, whsp);
+            if (*p == '\0')
+                break;
+            tok[n] = p;
+            len[n] = strcspn(p, whsp);
+            p += len[n];
+        }
+        if (n == 0) continue; // blank line
+
+        for (op = 0; table[op].cmd != NULL; op++) {
+            if (strlen(table[op].cmd) == len[0] && !strncmp(table[op].cmd, tok[0], len[0]))
+                break;
+        }
+        if (table[op].cmd == NULL) {
+            fprintf(stderr, "line %d: command not found: %.*s\n", lineno, (int)len[0], tok[0]);
+            errors++;
+            continue;
+        }
+        if ((n > 1 && len[1] > ARGMAX) || (n > 2 && len[2] > ARGMAX)) {
+            fprintf(stderr, "line %d: argument longer than %d characters\n", lineno, ARGMAX);
+            errors++;
+            continue;
+        }
+
+        putc(table[op].op, out);
+        for (int k = 1; k <= 2; k++) {
+            putc(k < n ? (int)len[k] : 0, out);
+            if (k < n)
+                fwrite(tok[k], 1, len[k], out);
+            putc('\0', out);
+        }
+    }
+    free(line);
+    return errors ? 1 : 0;
+}
+
+/* size of the record at p, 0 if fewer than avail Byte hold all of it */
+size_t record_size(uint8_t *p, size_t avail) {
+    size_t size = 2; /* opcode, filename length */
+
+    if (avail < size)
+        return 0;
+    size += p[1] + 2; /* filename, '\0', filesize length */
+    if (avail < size)
+        return 0;
+    size += p[size - 1] + 1; /* filesize, '\0' */
+    return avail < size ? 0 : size;
+}
+
+int run_binary(int fd) {
+    static uint8_t buf[CHUNKSIZE];
+    size_t have = 0, pos = 0, size;
+    long offset = 0; /* of buf[pos] in the stream, for error messages */
+    struct action *byop[256] = { NULL }, *a;
+    int magic = 0, eof = 0;
+    ssize_t got;
+    uint8_t *r;
+    char *name, *fsz;
+
+    for (a = table; a->cmd != NULL; a++)
+        byop[a->op] = a;
+
+    for (;;) {
+        r = &buf[pos];
+        if (magic)
+            size = record_size(r, have - pos);
+        else
+            size = have - pos >= 4 ? 4 : 0;
+
+        if (size == 0) { /* keep the partial record, read behind it */
+            if (eof)
+                break;
+            memmove(buf, r, have - pos);
+            have -= pos;
+            pos = 0;
+            got = read(fd, &buf[have], CHUNKSIZE - have);
+            if (got <= 0)
+                eof = 1;
+            else
+                have += got;
+            continue;
+        }
+
+        if (!magic) {
+            if (memcmp(r, BINMAGIC, 4)) {
+                fprintf(stderr, "not a compiled command stream\n");
+                return 1;
+            }
+            magic = 1;
+        } else {
+            name = (char *)&r[2];
+            fsz = (char *)&r[r[1] + 4];
+            a = byop[r[0]];
+            if (a == NULL) {
+                fprintf(stderr, "unknown opcode %d at byte %ld\n", r[0], offset);
+                return 1;
+            }
+            if (r[1] > ARGMAX || r[r[1] + 3] > ARGMAX ||
+                name[r[1]] != '\0' || fsz[r[r[1] + 3]] != '\0') {
+                fprintf(stderr, "corrupted command stream at byte %ld\n", offset);
+                return 1;
+            }
+            if (debug) printf(":%s:%s:%s:\n", a->cmd, name, fsz);
+
+            int ret = (a->action)(name, fsz);
+            if (txn_check() == -1)
+                ret = -1;
+            if (ret == -1) {
+                printf("  %s %s %s: failed\n", a->cmd, name, fsz);
+            }
+        }
+        pos += size;
+        offset += size;
+    }
+
+    if (!magic || pos != have) {
+        fprintf(stderr, "truncated command stream at byte %ld\n", offset);
+        return 1;
+    }
+    return 0;
+}
+
+/*--------------------------------------------------------------------------------*/